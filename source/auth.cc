@@ -0,0 +1,5 @@
+#include "auth.hh"
+
+namespace inventory {
+    Authorizer g_authorizer;
+}
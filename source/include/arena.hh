@@ -0,0 +1,82 @@
+#ifndef LIBINV_ARENA_HH
+#define LIBINV_ARENA_HH
+#include <memory>
+#include <cstddef>
+#include <rapidjson/document.h>
+
+/* google coding style */
+
+namespace inventory::RPC {
+
+// Per-thread memory for server requests. The parsed request, call results
+// and the response are allocated here and released together once the
+// reply has been handed to the session. The first chunk is kept between
+// requests, so a typical request doesn't touch the heap for its JSON.
+class RequestArena {
+public:
+    typedef rapidjson::Document::AllocatorType Allocator;
+
+    static const size_t kChunkSize = 64 * 1024;
+
+    // Marks the lifetime of one request on this thread. Nested scopes
+    // (a request completed from within another one) share the arena; it is
+    // released when the outermost scope ends.
+    class Scope {
+    public:
+        Scope()
+        : m_arena(RequestArena::local()) {
+            m_arena.m_depth++;
+        }
+
+        ~Scope() {
+            if (--m_arena.m_depth == 0)
+                m_arena.release();
+        }
+
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+        Allocator &allocator() {
+            return m_arena.allocator();
+        }
+
+    private:
+        RequestArena &m_arena;
+    };
+
+    RequestArena()
+    : m_buffer(new char[kChunkSize]),
+      m_alloc(m_buffer.get(), kChunkSize, kChunkSize) {}
+
+    RequestArena(const RequestArena &) = delete;
+    RequestArena &operator=(const RequestArena &) = delete;
+
+    static RequestArena &local() {
+        thread_local RequestArena arena;
+        return arena;
+    }
+
+    Allocator &allocator() {
+        return m_alloc;
+    }
+
+    // bytes handed out since the last release
+    size_t size() const {
+        return m_alloc.Size();
+    }
+
+    // drops everything allocated so far; chunks past the first one go back
+    // to the heap
+    void release() {
+        m_alloc.Clear();
+    }
+
+private:
+    std::unique_ptr<char[]> m_buffer;
+    Allocator m_alloc;
+    int m_depth = 0;
+};
+
+}
+
+#endif
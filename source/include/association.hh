@@ -1,6 +1,7 @@
 #ifndef LIBINV_ASSOCIATION_HH
 #define LIBINV_ASSOCIATION_HH
 #include <set>
+#include <cstdint>
 #include <vector>
 #include <string>
 #include <stdexcept>
@@ -11,6 +12,7 @@
 #include <rapidjson/document.h>
 #include "key.hh"
 #include "database.hh"
+#include "lazy_state.hh"
 #include "rpc.hh"
 #include "exception.hh"
 #include "jsonrpc.hh"
@@ -20,13 +22,15 @@
 
 namespace inventory {
 
-extern std::shared_mutex g_association_rwlock;
 template<class Database, class Derived>
 class Association : public RPC::MethodRoster<Database,
                      Association<Database, Derived>> {
     typedef Association<Database, Derived> self;
 
 public:
+    static constexpr size_t kLinkPage = 100;
+    static constexpr size_t kMaxLinkPage = 1000;
+
     template<class AssocObject>
     void operator*=(AssocObject &object) {
         associate(object);
@@ -51,6 +55,7 @@ public:
     }
 
     void associate(const IndexKey &key) {
+        resolve();
         m_add.insert(key);
         m_remove.erase(key);
         m_assoc.insert(key);
@@ -71,6 +76,7 @@ public:
     }
 
     void disassociate(const IndexKey &key) {
+        resolve();
         m_remove.insert(key);
         m_add.erase(key);
         m_assoc.erase(key);
@@ -78,22 +84,33 @@ public:
     }
 
     void get(Database &db) {
-        std::shared_lock<std::shared_mutex> lock(g_association_rwlock);
         Derived &derived = static_cast<Derived &>(*this);
+        auto lock = db.read_lock(g_object_locks.at(derived.path().string()));
 
-        std::unique_ptr<kyotocabinet::DB::Cursor> cur(db.impl().cursor());
-        if (!cur->jump(LinkKey::prefix(derived.path())))
-            return;
+        load_begin();
+        for (const auto &record : db.scan(LinkKey::prefix(derived.path())))
+            load(LinkSeparator::string()[0], record.first, record.second);
+        on_get();
+    }
 
-        std::string path, value;
-        while (cur->get(&path, &value, true)) {
-            LinkKey lkey(path);
-            if (!lkey.good() || lkey.local_part() != derived.path())
-                break;
+    void load_begin() {
+        m_lazy.cancel();
+    }
 
-            m_assoc.insert(lkey.remote_part());
-        }
-        on_get();
+    bool load(char separator, std::string_view path, std::string_view value) {
+        if (separator != LinkSeparator::string()[0])
+            return false;
+
+        LinkKeyView lkey(path);
+        if (lkey.good())
+            m_assoc.emplace(std::string(lkey.remote_part()));
+        return true;
+    }
+
+    // Binds to db without reading; the records are loaded on first
+    // access to the state.
+    void get_lazy(Database &db) {
+        m_lazy.defer(db);
     }
 
     void on_get() { 
@@ -108,26 +125,27 @@ public:
     }
 
     void commit(Database &db) {
-        std::unique_lock<std::shared_mutex> lock(g_association_rwlock);
+        WriteBatch<Database> batch(db);
+        commit(db, batch);
+        batch.commit();
+        on_commit();
+    }
+
+    void commit(Database &db, WriteBatch<Database> &batch) {
         Derived &derived = static_cast<Derived &>(*this);
 
+        batch.lock(g_object_locks);
         for (const IndexKey &p : m_remove) {
             LinkKey link({derived.path(), p.string()});
-            if (!db.impl().remove(link))
-                throw std::runtime_error("Couldn't remove keys");
-            if (!db.impl().remove(link.inverted()))
-                throw std::runtime_error("Couldn't remove keys");
+            batch.remove(link);
+            batch.remove(link.inverted());
         }
 
         for (const IndexKey &p : m_add) {
             LinkKey link({derived.path(), p.string()});
-            if (!db.impl().set(link, ""))
-                throw std::runtime_error("Couldn't set kv");
-            if (!db.impl().set(link.inverted(), ""))
-                throw std::runtime_error("Couldn't set kv");
+            batch.set(link, "");
+            batch.set(link.inverted(), "");
         }
-
-        on_commit();
     }
 
     std::unique_ptr<JSONRPC::SingleRequest> build_update_request(
@@ -171,32 +189,68 @@ public:
         return jreq;
     }
 
+    // Links sort by remote type, so those of one type are a range.
     template<class AssocObject>
     std::vector<IndexKey> assoc_ids() {
+        resolve();
+        const std::string prefix = AssocObject::type() +
+                                   IndexSeparator::string();
         std::vector<IndexKey> result;
-        std::copy_if(m_assoc.begin(), m_assoc.end(),
-            std::back_inserter(result), [](const IndexKey &k) {
-                return k.type_part() == AssocObject::type();
-            });
+        for (auto it = m_assoc.lower_bound(IndexKey(prefix));
+                it != m_assoc.end() &&
+                !it->string().compare(0, prefix.size(), prefix); ++it)
+            result.push_back(*it);
         return result;
     }
 
+    // Without the links loaded, only those of AssocObject are read.
     template<class AssocObject>
-    SharedVector<AssocObject> assoc_objects(Database &db) {
-        SharedVector<AssocObject> result;
-        std::vector<IndexKey> assoc_idvec = assoc_ids<AssocObject>();
-        for (IndexKey &key : assoc_idvec) {
-            Shared<AssocObject> obj;
-            obj->get(db, key.id_part());
-            if (key.type_part() == AssocObject::type())
-                result.push_back(obj);
+    std::vector<IndexKey> assoc_ids(Database &db) {
+        if (!m_lazy.pending())
+            return assoc_ids<AssocObject>();
+
+        std::string next;
+        return link_page(db, AssocObject::type(), std::string(),
+                                               SIZE_MAX, &next);
+    }
+
+    // One page of the links to link_type objects, by a range scan over
+    // that type alone. A page resumes after the remote key cursor; next is
+    // set to the cursor of the following page, empty after the last one.
+    std::vector<IndexKey> link_page(Database &db, const std::string &link_type,
+                   const std::string &cursor, size_t limit, std::string *next) {
+        Derived &derived = static_cast<Derived &>(*this);
+        const std::string local = LinkKey::prefix(derived.path());
+        const std::string prefix = local + link_type +
+                                   IndexSeparator::string();
+        auto lock = db.read_lock(g_object_locks.at(derived.path().string()));
+
+        std::vector<IndexKey> result;
+        next->clear();
+        for (const auto &record : db.scan(prefix, cursor.empty() ?
+                                   std::string() : local + cursor)) {
+            LinkKeyView lkey(record.first);
+            if (!lkey.good() || lkey.remote_part() == cursor)
+                continue;
+            if (result.size() == limit) {
+                *next = result.back().string();
+                break;
+            }
+            result.emplace_back(std::string(lkey.remote_part()));
         }
         return result;
     }
 
+    template<class AssocObject>
+    SharedVector<AssocObject> assoc_objects(Database &db) {
+        return SharedVector<AssocObject>::load(db,
+                        assoc_ids<AssocObject>(db));
+    }
+
     // just ids, use SharedVector::get to get full repr 
     template<class AssocObject>                            
     SharedVector<AssocObject> assoc_objects() {        
+        resolve();
         SharedVector<AssocObject> result;                  
         for (const IndexKey &key : m_assoc) {                
             Shared<AssocObject> obj(key);
@@ -209,6 +263,7 @@ public:
     static const std::vector<RPC::Method<Database, self>> &methods() {
         static const std::vector<RPC::Method<Database, self>> ret({
             RPC::Method<Database, self>("link.update", &self::rpc_update),
+            RPC::Method<Database, self>("link.list", &self::rpc_list),
         });
         return ret;
     }
@@ -230,29 +285,89 @@ public:
         return rapidjson::Value("OK");
     }
 
+    // params: link_type, and optionally cursor (from the previous page)
+    // and limit. Returns {"links": [...], "cursor": next page or null}.
+    rapidjson::Value rpc_list(Database &db, const RPC::SingleCall &call,
+                            rapidjson::Document::AllocatorType &alloc) {
+        using namespace rapidjson;
+        Derived &derived = static_cast<Derived &>(*this);
+        derived.rpc_get_index(call);
+        if (!derived.exists(db))
+            throw exceptions::NoSuchObject(derived.type(), derived.id());
+
+        const RPC::ObjectCallParams params(call);
+        const Value &jlink_type = params["link_type"];
+        if (!jlink_type.IsString()) {
+            throw RPC::exceptions::InvalidParameters("\"link_type\" is not "
+                                                               "a string");
+        }
+        std::string link_type = jlink_type.GetString();
+
+        std::string cursor;
+        if (params.has_member("cursor")) {
+            const Value &jcursor = params["cursor"];
+            if (!jcursor.IsString() ||
+                 IndexKey(jcursor.GetString()).type_part() != link_type)
+                throw RPC::exceptions::InvalidParameters("bad \"cursor\"");
+            cursor = jcursor.GetString();
+        }
+
+        size_t limit = kLinkPage;
+        if (params.has_member("limit")) {
+            const Value &jlimit = params["limit"];
+            if (!jlimit.IsUint() || !jlimit.GetUint())
+                throw RPC::exceptions::InvalidParameters("bad \"limit\"");
+            limit = std::min<size_t>(jlimit.GetUint(), kMaxLinkPage);
+        }
+
+        std::string next;
+        std::vector<IndexKey> links = link_page(db, link_type, cursor,
+                                                          limit, &next);
+        RPC::authorize_listing(db, call, links);
+
+        Value jlinks(kArrayType);
+        for (const IndexKey &key : links) {
+            Value jkey;
+            jkey.SetString(key.string().c_str(), alloc);
+            jlinks.PushBack(jkey, alloc);
+        }
+        Value jnext(kNullType);
+        if (!next.empty())
+            jnext.SetString(next.c_str(), alloc);
+
+        Value jresult(kObjectType);
+        jresult.AddMember("links", jlinks, alloc);
+        jresult.AddMember("cursor", jnext, alloc);
+        return jresult;
+    }
+
     static const std::string &mixin_type() {
         static const std::string type("associative");
         return type;
     }
 
     rapidjson::Value repr(rapidjson::Document::AllocatorType &alloc) const {
+        resolve();
         rapidjson::Value rarr(rapidjson::kArrayType);
         repr(rarr, alloc);
         return rarr;
     }
 
     rapidjson::Document repr() const {
+        resolve();
         rapidjson::Document rdoc(rapidjson::kArrayType);
         repr(rdoc, rdoc.GetAllocator());
         return rdoc;
     }
 
     void from_repr(const rapidjson::Value &array) {
+        resolve();
         clear();
         assoc_set_batch(array);
     }
 
     void clear() {
+        resolve();
         for (const IndexKey &key : m_assoc)
             m_remove.insert(key);
         m_assoc.clear();
@@ -261,6 +376,16 @@ public:
         m_modified = true;
     }
 
+    // empties the state for reuse by an object pool
+    void reset() {
+        m_lazy.cancel();
+        m_assoc.clear();
+        m_add.clear();
+        m_remove.clear();
+        m_modified = false;
+        m_db_backed = false;
+    }
+
     bool modified() const {
         return m_modified;
     }
@@ -278,6 +403,11 @@ public:
     }
 
 private:
+    void resolve() const {
+        if (m_lazy.pending())
+            const_cast<self &>(*this).get(m_lazy.take());
+    }
+
     void assoc_set_single(const rapidjson::Value &object) {
         if (!object.IsString())
             throw exceptions::InvalidRepr("array member is not a string");
@@ -315,6 +445,7 @@ private:
     }
 
     std::set<IndexKey> m_assoc;
+    LazyState<Database> m_lazy;
     std::set<IndexKey> m_add;
     std::set<IndexKey> m_remove;
     bool m_modified = false;
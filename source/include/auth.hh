@@ -1,24 +1,183 @@
 #ifndef LIBINV_AUTH_HH
 #define LIBINV_AUTH_HH
 #include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
 #include "database.hh"
 #include "shared_wrapper.hh"
+#include "key.hh"
+#include "mode.hh"
+#include "object_header.hh"
+#include "lock_table.hh"
 
 namespace inventory {
 
 class User {
 public:
-    User(std::string handle)
-    : m_handle(handle) {}
+    User(std::string handle, std::vector<std::string> groups = {})
+    : m_handle(handle), m_groups(std::move(groups)) {}
 
     std::string handle() const {
         return m_handle;
     }
 
+    const std::vector<std::string> &groups() const {
+        return m_groups;
+    }
+
+private:
+    std::string m_handle;
+    std::vector<std::string> m_groups;
+};
+
+// The handles a user acts as: its own, matched against the USER bits of a
+// mode, and its groups, matched against the GROUP bits. OTHER bits of any
+// mode apply to everyone.
+class Credentials {
+public:
+    Credentials(const User &user)
+    : m_handle(user.handle()), m_groups(user.groups()) {
+        std::sort(m_groups.begin(), m_groups.end());
+        m_groups.erase(std::unique(m_groups.begin(), m_groups.end()),
+                                                     m_groups.end());
+    }
+
+    const std::string &handle() const {
+        return m_handle;
+    }
+
+    // rights a single mode table entry grants
+    int rights(std::string_view handle, Mode mode) const {
+        int bits = mode.bits();
+        int ret = bits >> (OTHER * 3) & 7;
+        if (handle == m_handle)
+            ret |= bits >> (USER * 3) & 7;
+        else if (std::binary_search(m_groups.begin(), m_groups.end(), handle))
+            ret |= bits >> (GROUP * 3) & 7;
+        return ret;
+    }
+
 private:
     std::string m_handle;
+    std::vector<std::string> m_groups;
+};
+
+// Server-side authorization of result sets. Users get their groups from
+// the group source; credentials are cached per handle along with the
+// groups they were built from and rebuilt when a user comes with others,
+// so membership changes take effect with the next user resolved.
+class Authorizer {
+public:
+    // groups of a user handle
+    typedef std::function<std::vector<std::string>(const std::string &)>
+                                                            GroupSource;
+
+    // Replaces the group source, nullptr for none; drops all credentials.
+    void set_group_source(GroupSource source) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_group_source = std::move(source);
+        m_credentials.clear();
+    }
+
+    // handle with its groups from the group source
+    User user(const std::string &handle) {
+        GroupSource source;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            source = m_group_source;
+        }
+        if (!source)
+            return User(handle);
+        return User(handle, source(handle));
+    }
+
+    std::shared_ptr<const Credentials> credentials(const User &user) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Entry &entry = m_credentials[user.handle()];
+        if (!entry.creds || entry.groups != user.groups()) {
+            entry.groups = user.groups();
+            entry.creds = std::make_shared<const Credentials>(user);
+        }
+        return entry.creds;
+    }
+
+    void invalidate(const std::string &handle) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_credentials.erase(handle);
+    }
+
+    // Rights on each of keys, one header read per object. Objects without
+    // modes are unrestricted, missing objects grant nothing.
+    template<class Database>
+    std::vector<uint8_t> rights(Database &db, const Credentials &creds,
+                                      const std::vector<IndexKey> &keys) {
+        std::vector<uint8_t> ret(keys.size(), 0);
+        std::string value;
+        for (size_t i = 0; i < keys.size(); i++) {
+            const std::string &key = keys[i].string();
+            if (!db.may_exist(key))
+                continue;
+
+            auto lock = db.read_lock(g_object_locks.at(key));
+            if (!db.impl().get(key, &value))
+                continue;
+
+            int granted = 0;
+            bool moded = false;
+            auto entry = [&](std::string_view handle, Mode mode) {
+                granted |= creds.rights(handle, mode);
+                moded = true;
+            };
+            if (!ObjectHeader::visit_modes(value, entry)) {
+                for (const auto &record : db.scan(ModeKey::prefix(key))) {
+                    ModeKeyView mkey(record.first);
+                    if (mkey.good())
+                        entry(mkey.handle_part(),
+                              Mode(std::string(record.second)));
+                }
+            }
+            ret[i] = moded ? granted : 7;
+        }
+        return ret;
+    }
+
+    // Drops the keys user has no right on, keeping their order.
+    template<class Database>
+    void filter(Database &db, const User &user, std::vector<IndexKey> &keys,
+                                                           Right right) {
+        std::shared_ptr<const Credentials> creds = credentials(user);
+        std::vector<uint8_t> granted = rights(db, *creds, keys);
+
+        size_t kept = 0;
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (granted[i] & right) {
+                if (kept != i)
+                    keys[kept] = std::move(keys[i]);
+                kept++;
+            }
+        }
+        keys.resize(kept);
+    }
+
+private:
+    struct Entry {
+        std::vector<std::string> groups;
+        std::shared_ptr<const Credentials> creds;
+    };
+
+    std::mutex m_mutex;
+    GroupSource m_group_source;
+    std::unordered_map<std::string, Entry> m_credentials;
 };
 
+extern Authorizer g_authorizer;
+
 }
 
 #endif
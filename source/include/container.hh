@@ -2,6 +2,7 @@
 #define LIBINV_CONTAINER_HH
 #include <string>
 #include <map>
+#include <set>
 #include <vector>
 #include <stdexcept>
 #include <memory>
@@ -15,6 +16,7 @@
 #include "exception.hh"
 #include "jsonrpc.hh"
 #include "uuid.hh"
+#include "lazy_state.hh"
 
 namespace inventory {
 
@@ -31,7 +33,8 @@ public:
     : m_key(key), m_container(c) {}
 
     std::string operator=(std::string value) {
-        return m_container.m_attrs[m_key] = value;
+        m_container.set(m_key, value);
+        return value;
     }
 
     const bool exists() {
@@ -54,7 +57,8 @@ public:
         if (!exists())
             return;
         m_container.m_attrs.erase(m_key);
-        m_container.m_delete.push_back(m_key);
+        m_container.m_dirty.erase(m_key);
+        m_container.m_delete.insert(m_key);
     }
 
 protected:
@@ -62,7 +66,6 @@ protected:
     Container &m_container;
 };
 
-extern std::shared_mutex g_container_rwlock;
 template<class Database, class Derived>
 class Container : public RPC::MethodRoster<Database,
                      Container<Database, Derived>> {
@@ -72,59 +75,80 @@ public:
     friend class Attribute<self>;
 
     typedef std::map<std::string, std::string> AttrMap;
-    typedef std::vector<std::string> IdVec;
+    typedef std::set<std::string> IdSet;
 
     void get(Database &db) {
-        std::shared_lock<std::shared_mutex> lock(g_container_rwlock);
         Derived &derived = static_cast<Derived &>(*this);
+        auto lock = db.read_lock(g_object_locks.at(derived.path().string()));
 
-        std::unique_ptr<kyotocabinet::DB::Cursor> cur(db.impl().cursor());
-        if (!cur->jump(AttributeKey::prefix(derived.path())))
-            return;
-
-        std::string path, value;
-        while (cur->get(&path, &value, true)) {
-            if (!derived.db_key_match(AttributeKey(path).container_part()))
-                break;
-//TODO
-            try {
-                std::string ak = AttributeKey(path).attribute_part();
-                m_attrs[ak] = value;
-            } catch (std::out_of_range &oo) {}
+        load_begin();
+        for (const auto &record : db.scan(AttributeKey::prefix(
+                                                derived.path()))) {
+            load(AttributeSeparator::string()[0], record.first,
+                                                  record.second);
         }
         on_get();
     }
 
+    void load_begin() {
+        m_lazy.cancel();
+        m_attrs.clear();
+    }
+
+    // takes the attribute records of a single-pass object load
+    bool load(char separator, std::string_view path, std::string_view value) {
+        if (separator != AttributeSeparator::string()[0])
+            return false;
+
+        AttributeKeyView key(path);
+        if (key.good()) {
+            std::string name(key.attribute_part());
+            m_attrs[name] = std::string(value);
+            m_dirty.erase(name);
+            m_delete.erase(name);
+        }
+        return true;
+    }
+
+    // Binds to db without reading; the records are loaded on first
+    // access to the state.
+    void get_lazy(Database &db) {
+        m_lazy.defer(db);
+    }
+
     void on_commit() {
         m_delete.clear();
+        m_dirty.clear();
         m_db_backed = true;
     }
 
+    // the attributes now mirror the stored ones, whether read from db or
+    // filled from a server repr
     void on_get() {
+        m_dirty.clear();
+        m_delete.clear();
         m_db_backed = true;
     }
 
     void commit(Database &db) {
-        std::unique_lock<std::shared_mutex> lock(g_container_rwlock);
+        WriteBatch<Database> batch(db);
+        commit(db, batch);
+        batch.commit();
+        on_commit();
+    }
+
+    // writes only the attributes set or removed since the last commit
+    void commit(Database &db, WriteBatch<Database> &batch) {
         Derived *derived = static_cast<Derived *>(this);
         std::string container_path = derived->path();
 
-        for (std::string &id : m_delete) {
-            std::string attribute_path = Attribute<self>::db_key(container_path,
-                                                                            id);
-            if (!db.impl().remove(attribute_path))
-                throw std::runtime_error("Couldn't remove key");
-        }
-
-        for (auto &kv : m_attrs) {
-            std::string attribute_path = Attribute<self>::db_key(container_path,
-                                                                      kv.first);
-            if (!db.impl().set(attribute_path, kv.second))
-                throw std::runtime_error("Couldn't set kv (" + attribute_path
-                      + "," + kv.second + ")" + db.impl().error().message());
-        }
-        on_commit();
-    } 
+        batch.lock(g_object_locks);
+        for (const std::string &id : m_delete)
+            batch.remove(Attribute<self>::db_key(container_path, id));
+        for (const std::string &id : m_dirty)
+            batch.set(Attribute<self>::db_key(container_path, id),
+                                                     m_attrs[id]);
+    }
 
     std::unique_ptr<JSONRPC::SingleRequest> build_update_request(
                      rapidjson::Document::AllocatorType &alloc) {
@@ -134,7 +158,7 @@ public:
         Derived &derived = static_cast<Derived &>(*this);        
         auto jreq = std::make_unique<JSONRPC::SingleRequest>(&alloc);
         jreq->id(derived.id() + ":" + uuid_string());
-        jreq->method("object.attribute.repr.set");
+        jreq->method("object.attribute.update");
         jreq->params(true);
 
         using namespace rapidjson;
@@ -146,19 +170,43 @@ public:
         jtype.SetString(Derived::type().c_str(), jreq->allocator());
         jreq->params().AddMember("type", jtype, jreq->allocator());
 
-        Value jrepr = repr(jreq->allocator());
-        jreq->params().AddMember("repr", jrepr, jreq->allocator());
+        Value jset(kObjectType);
+        for (const std::string &id : m_dirty) {
+            Value attrn(id.c_str(), jreq->allocator());
+            Value attrv(m_attrs[id].c_str(), jreq->allocator());
+            jset.AddMember(attrn, attrv, jreq->allocator());
+        }
+        jreq->params().AddMember("set", jset, jreq->allocator());
+
+        Value jremove(kArrayType);
+        for (const std::string &id : m_delete) {
+            Value attrn(id.c_str(), jreq->allocator());
+            jremove.PushBack(attrn, jreq->allocator());
+        }
+        jreq->params().AddMember("remove", jremove, jreq->allocator());
         return jreq;
     }
 
-    AttrMap &attributes() {
+    // read-only; changes go through operator[] so they're committed
+    const AttrMap &attributes() const {
+        resolve();
         return m_attrs;
     }
 
     Attribute<self> operator[](std::string key) {
+        resolve();
         return Attribute<self>(key, *this);
     }
 
+    // point lookup of one attribute record, without loading the others
+    bool get_attribute(Database &db, const std::string &key,
+                                     std::string *value) {
+        Derived &derived = static_cast<Derived &>(*this);
+        AttributeKey akey = Attribute<self>::db_key(derived.path(), key);
+        auto lock = db.read_lock(g_object_locks.at(akey.string()));
+        return db.impl().get(akey, value);
+    }
+
     Attribute<self> attribute(std::string key) {
         return (*this)[key];
     }
@@ -196,6 +244,32 @@ public:
         return rapidjson::Value("OK");
     }
 
+    // params: "set" object of attributes, "remove" array of names
+    rapidjson::Value rpc_attribute_update(Database &db,
+                                        const RPC::SingleCall &call,
+                                        rapidjson::Document::AllocatorType &alloc) {
+        Derived &derived = static_cast<Derived &>(*this);
+        derived.rpc_get_index(call);
+        if (!derived.exists(db))
+            throw exceptions::NoSuchObject(derived.type(), derived.id());
+
+        const rapidjson::Value &jremove = RPC::ObjectCallParams(call)["remove"];
+        if (!jremove.IsArray())
+            throw exceptions::InvalidRepr("remove is not an array");
+        for (const rapidjson::Value &attrn : jremove.GetArray()) {
+            if (!attrn.IsString())
+                throw exceptions::InvalidRepr("key is not a string");
+            m_delete.insert(attrn.GetString());
+        }
+        attribute_set_batch(RPC::ObjectCallParams(call)["set"]);
+        commit(db);
+
+        // never generate responses to notifications
+        if (call.jsonrpc()->is_notification())
+            return rapidjson::Value(rapidjson::kNullType);
+        return rapidjson::Value("OK");
+    }
+
     rapidjson::Value rpc_attribute_get(Database &db, const RPC::SingleCall &call,
                                      rapidjson::Document::AllocatorType &alloc) {
         // never generate responses to notifications
@@ -204,15 +278,15 @@ public:
 
         Derived &derived = static_cast<Derived &>(*this);
         derived.rpc_get_index(call);
-        if (!derived.exists(db))
-            throw exceptions::NoSuchObject(derived.type(), derived.id());
 
-        // TODO optimize
-        get(db);
-        return rapidjson::Value(
-            (*this)[RPC::ObjectCallParams(call)["key"].GetString()],
-            alloc
-        );
+        // an attribute record implies the object, exists() only tells a
+        // missing attribute from a missing object
+        std::string value;
+        if (!get_attribute(db, RPC::ObjectCallParams(call)["key"].GetString(),
+                                              &value) && !derived.exists(db)) {
+            throw exceptions::NoSuchObject(derived.type(), derived.id());
+        }
+        return rapidjson::Value(value.c_str(), alloc);
     }
 
     static const std::vector<RPC::Method<Database, self>> &methods() {
@@ -220,6 +294,7 @@ public:
             RPC::Method<Database, self>("attribute.list", &self::rpc_attribute_list),
             RPC::Method<Database, self>("attribute.get", &self::rpc_attribute_get),
             RPC::Method<Database, self>("attribute.set", &self::rpc_attribute_set),
+            RPC::Method<Database, self>("attribute.update", &self::rpc_attribute_update),
             RPC::Method<Database, self>("attribute.repr.get", &self::rpc_repr_get),
             RPC::Method<Database, self>("attribute.repr.set", &self::rpc_repr_set),
         });
@@ -250,7 +325,6 @@ public:
             throw exceptions::NoSuchObject(derived.type(), derived.id());
 
         get(db);
-        clear();
         from_repr(RPC::ObjectCallParams(call)["repr"]);
         commit(db);
 
@@ -261,36 +335,61 @@ public:
     }
 
     rapidjson::Value repr(rapidjson::Document::AllocatorType &alloc) const {
+        resolve();
         rapidjson::Value rarr(rapidjson::kObjectType);
         repr(rarr, alloc);
         return rarr;
     }
 
     rapidjson::Document repr() const {
+        resolve();
         rapidjson::Document doc(rapidjson::kObjectType);
         repr(doc, doc.GetAllocator());
         return doc;
     }
 
+    // Replaces the attributes; only the difference is committed.
     void from_repr(const rapidjson::Value &object) {
-        clear();
+        resolve();
+        if (!object.IsObject())
+            throw exceptions::InvalidRepr("kv dict is not an object");
+
+        for (auto it = m_attrs.begin(); it != m_attrs.end();) {
+            if (object.HasMember(it->first.c_str())) {
+                ++it;
+                continue;
+            }
+            m_dirty.erase(it->first);
+            m_delete.insert(it->first);
+            it = m_attrs.erase(it);
+        }
         attribute_set_batch(object);
     }
 
     void clear() {
+        resolve();
         for (const auto &attrp : m_attrs)
-            m_delete.push_back(attrp.first);
+            m_delete.insert(attrp.first);
         m_attrs.clear();
-
-        //m_modified = true;
+        m_dirty.clear();
     }
 
     void clear_attributes() {
         clear();
     }
 
+    // empties the state for reuse by an object pool, without marking
+    // anything for removal
+    void reset() {
+        m_lazy.cancel();
+        m_attrs.clear();
+        m_dirty.clear();
+        m_delete.clear();
+        m_db_backed = false;
+    }
+
     bool modified() const {
-        return true; // TODO compute the difference
+        return !m_dirty.empty() || !m_delete.empty();
     }
 
     bool db_backed() const {
@@ -301,10 +400,32 @@ public:
         m_db_backed = state;
     }
 
+    // true marks every attribute for rewrite, false forgets the changes
     void set_modified(bool state) {
+        m_dirty.clear();
+        if (!state) {
+            m_delete.clear();
+            return;
+        }
+        for (const auto &attrp : m_attrs)
+            m_dirty.insert(attrp.first);
     }
 
 private:
+    void resolve() const {
+        if (m_lazy.pending())
+            const_cast<self &>(*this).get(m_lazy.take());
+    }
+
+    void set(const std::string &key, const std::string &value) {
+        auto it = m_attrs.find(key);
+        if (it != m_attrs.end() && it->second == value)
+            return;
+        m_attrs[key] = value;
+        m_dirty.insert(key);
+        m_delete.erase(key);
+    }
+
     void attribute_set_batch(const rapidjson::Value &obj) {
         if (!obj.IsObject())
             throw exceptions::InvalidRepr("kv dict is not an object");
@@ -329,7 +450,9 @@ private:
     }
 
     AttrMap m_attrs;
-    IdVec m_delete;
+    IdSet m_dirty;
+    IdSet m_delete;
+    LazyState<Database> m_lazy;
     bool m_db_backed = false;
 };
 
@@ -1,7 +1,24 @@
 #ifndef LIBINV_DATABASE_HH
 #define LIBINV_DATABASE_HH
 #include <kcpolydb.h>
+#include <kccompare.h>
+#include <cstdint>
+#include <string>
+#include <map>
+#include <vector>
+#include <unordered_set>
+#include <memory>
+#include <chrono>
+#include <mutex>
+#include <shared_mutex>
+#include <algorithm>
 #include <stdexcept>
+#include "write_batch.hh"
+#include "group_commit.hh"
+#include "scan.hh"
+#include "object_cache.hh"
+#include "existence_filter.hh"
+#include "lock_table.hh"
 
 /* google coding style */
 
@@ -10,49 +27,463 @@ namespace inventory {
 class NullDBBackend {
 };
 
+// Backend tuning. Zeroed members leave Kyoto Cabinet defaults in place,
+// members a backend doesn't support are ignored.
+struct DatabaseOptions {
+    enum class Comparator {
+        LEXICAL, // required by datamodel objects (prefix scans)
+        DECIMAL
+    };
+
+    int64_t page_cache = 0; // TreeDB/GrassDB page cache, bytes
+    int64_t map_size = 0;   // TreeDB/HashDB mmap region, bytes
+    int64_t buckets = 0;    // hash bucket count
+    int32_t page_size = 0;  // TreeDB/GrassDB page size, bytes
+    int8_t alignment = 0;   // TreeDB/HashDB record alignment, power of 2
+    bool compress = false;  // zlib record compression
+    Comparator comparator = Comparator::LEXICAL;
+    int64_t cap_count = 0;  // CacheDB record limit
+    int64_t cap_size = 0;   // CacheDB memory limit, bytes
+    // Opens without the file lock so other processes may hold the writer.
+    // Records a writer touches during a scan may be seen half-updated;
+    // long scans should read a snapshot() instead.
+    bool read_only = false;
+    // object row cache, bytes; not used on read-only opens, where
+    // other processes write behind its back
+    int64_t object_cache = 0;
+    // Bloom filter over index records, saved to <file>.exists; not used
+    // on read-only opens either
+    bool existence_filter = false;
+};
+
+// Applies DatabaseOptions to a backend before it's opened. ordered tells
+// whether cursors iterate in key order, which mixin prefix scans depend on;
+// unordered backends are meant for point lookups.
+template<class kdb>
+class Backend {
+public:
+    static constexpr bool ordered = true;
+    static constexpr bool persistent = true;
+
+    static void tune(kdb &db, const DatabaseOptions &options) {}
+};
+
+namespace util {
+    inline kyotocabinet::Comparator *kc_comparator(
+             DatabaseOptions::Comparator comparator) {
+        switch (comparator) {
+        case DatabaseOptions::Comparator::DECIMAL:
+            return kyotocabinet::DECIMALCOMP;
+        default:
+            return kyotocabinet::LEXICALCOMP;
+        }
+    }
+
+    inline void check_tune(bool result, const char *param) {
+        if (!result)
+            throw std::runtime_error(std::string("Couldn't tune ") + param);
+    }
+}
+
+template<>
+class Backend<kyotocabinet::TreeDB> {
+public:
+    static constexpr bool ordered = true;
+    static constexpr bool persistent = true;
+
+    static void tune(kyotocabinet::TreeDB &db, const DatabaseOptions &options) {
+        using namespace kyotocabinet;
+        using util::check_tune;
+
+        if (options.compress)
+            check_tune(db.tune_options(TreeDB::TCOMPRESS), "options");
+        if (options.page_cache)
+            check_tune(db.tune_page_cache(options.page_cache), "page cache");
+        if (options.map_size)
+            check_tune(db.tune_map(options.map_size), "map size");
+        if (options.buckets)
+            check_tune(db.tune_buckets(options.buckets), "buckets");
+        if (options.page_size)
+            check_tune(db.tune_page(options.page_size), "page size");
+        if (options.alignment)
+            check_tune(db.tune_alignment(options.alignment), "alignment");
+        check_tune(db.tune_comparator(util::kc_comparator(
+                            options.comparator)), "comparator");
+    }
+};
+
+template<>
+class Backend<kyotocabinet::HashDB> {
+public:
+    static constexpr bool ordered = false;
+    static constexpr bool persistent = true;
+
+    static void tune(kyotocabinet::HashDB &db, const DatabaseOptions &options) {
+        using namespace kyotocabinet;
+        using util::check_tune;
+
+        if (options.compress)
+            check_tune(db.tune_options(HashDB::TCOMPRESS), "options");
+        if (options.map_size)
+            check_tune(db.tune_map(options.map_size), "map size");
+        if (options.buckets)
+            check_tune(db.tune_buckets(options.buckets), "buckets");
+        if (options.alignment)
+            check_tune(db.tune_alignment(options.alignment), "alignment");
+    }
+};
+
+template<>
+class Backend<kyotocabinet::CacheDB> {
+public:
+    static constexpr bool ordered = false;
+    static constexpr bool persistent = false;
+
+    static void tune(kyotocabinet::CacheDB &db, const DatabaseOptions &options) {
+        using namespace kyotocabinet;
+        using util::check_tune;
+
+        if (options.compress)
+            check_tune(db.tune_options(CacheDB::TCOMPRESS), "options");
+        if (options.buckets)
+            check_tune(db.tune_buckets(options.buckets), "buckets");
+        if (options.cap_count)
+            check_tune(db.cap_count(options.cap_count), "record limit");
+        if (options.cap_size)
+            check_tune(db.cap_size(options.cap_size), "memory limit");
+    }
+};
+
+template<>
+class Backend<kyotocabinet::GrassDB> {
+public:
+    static constexpr bool ordered = true;
+    static constexpr bool persistent = false;
+
+    static void tune(kyotocabinet::GrassDB &db, const DatabaseOptions &options) {
+        using namespace kyotocabinet;
+        using util::check_tune;
+
+        if (options.compress)
+            check_tune(db.tune_options(GrassDB::TCOMPRESS), "options");
+        if (options.page_cache)
+            check_tune(db.tune_page_cache(options.page_cache), "page cache");
+        if (options.buckets)
+            check_tune(db.tune_buckets(options.buckets), "buckets");
+        if (options.page_size)
+            check_tune(db.tune_page(options.page_size), "page size");
+        check_tune(db.tune_comparator(util::kc_comparator(
+                            options.comparator)), "comparator");
+    }
+};
+
+// std::map-backed; nothing to tune
+template<>
+class Backend<kyotocabinet::ProtoTreeDB> {
+public:
+    static constexpr bool ordered = true;
+    static constexpr bool persistent = false;
+
+    static void tune(kyotocabinet::ProtoTreeDB &db,
+                     const DatabaseOptions &options) {}
+};
+
 template<class kdb = kyotocabinet::TreeDB>
 class Database {
 public:
+    typedef kdb Impl;
+
+    static constexpr bool ordered = Backend<kdb>::ordered;
+    static constexpr bool persistent = Backend<kdb>::persistent;
+
     ~Database() {
         close();
     }
 
-    void open(std::string file) {
-        using namespace kyotocabinet;
-
-        if (!m_db.open(file, TreeDB::OWRITER | TreeDB::OCREATE))
-            throw std::runtime_error("Couldn't open file: " + file);
+    // in-memory backends ignore the file name
+    void open(std::string file, const DatabaseOptions &options = {}) {
+        Backend<kdb>::tune(m_db, options);
+        uint32_t mode = options.read_only ? kdb::OREADER | kdb::ONOLOCK
+                                          : kdb::OWRITER | kdb::OCREATE;
+        if (!m_db.open(file, mode)) {
+            throw std::runtime_error("Couldn't open file: " + file + " ("
+                                        + m_db.error().message() + ")");
+        }
+        m_options = options;
+        if (options.object_cache && !options.read_only)
+            m_cache.reset(new ObjectCache(options.object_cache));
+        if (options.existence_filter && !options.read_only) {
+            m_filter.reset(new ExistenceFilter);
+            m_filter->open(m_db, persistent ? file + ".exists" : "");
+        }
     }
 
     void close() {
+        disable_group_commit();
+        if (m_filter)
+            m_filter->close(m_db);
         m_db.close();
+        m_cache.reset();
+        m_filter.reset();
     }
 
     void clear() {
         m_db.clear();
+        if (m_cache)
+            m_cache->clear();
+        if (m_filter)
+            m_filter->clear();
+    }
+
+    // false only if the index record key was never written
+    bool may_exist(const std::string &key) const {
+        return !m_filter || m_filter->may_contain(key);
+    }
+
+    // nullptr unless DatabaseOptions::object_cache is set
+    ObjectCache *cache() {
+        return m_cache.get();
+    }
+
+    // Routes WriteBatch commits through a writer thread which merges
+    // concurrent batches into one transaction.
+    void enable_group_commit(SyncPolicy policy = SyncPolicy::NONE,
+             std::chrono::milliseconds interval = std::chrono::milliseconds(0)) {
+        check_writable();
+        disable_group_commit();
+        m_writer.reset(new GroupCommitWriter<Database>(*this, policy,
+                                                       interval));
+    }
+
+    // drains and synchronizes pending batches
+    void disable_group_commit() {
+        m_writer.reset();
+    }
+
+    GroupCommitWriter<Database> *group_commit() {
+        return m_writer.get();
+    }
+
+    bool synchronize(bool hard = false) {
+        return m_db.synchronize(hard);
+    }
+
+    // Copies the records to a new database in file and opens it read-only,
+    // for scans that shouldn't contend with writers. Each object is copied
+    // in one go under its stripe read lock, so a commit only waits for the
+    // object it writes. Every object is consistent on its own, but objects
+    // are copied at different times: a batch spanning several objects may
+    // be seen partly applied. In-memory backends have no file to reopen,
+    // so they can't be snapshotted.
+    std::unique_ptr<Database> snapshot(std::string file) {
+        if (!persistent)
+            throw std::runtime_error("Snapshots need a file backend");
+        copy_records(file);
+
+        DatabaseOptions options = m_options;
+        options.read_only = true;
+        std::unique_ptr<Database> copy(new Database);
+        copy->open(file, options);
+        return copy;
+    }
+
+    bool read_only() const {
+        return m_options.read_only;
+    }
+
+    // Readers take the shared side of a mixin lock to keep out writers in
+    // this process. A read-only database has none, so nothing is locked.
+    std::shared_lock<std::shared_mutex> read_lock(std::shared_mutex &mutex) {
+        if (read_only())
+            return std::shared_lock<std::shared_mutex>(mutex, std::defer_lock);
+        return std::shared_lock<std::shared_mutex>(mutex);
     }
 
     kdb &impl() {
         return m_db;
     }
 
+    PrefixScan scan(const std::string &prefix,
+                    const std::string &from = std::string(),
+                    const std::string &end = std::string()) {
+        static_assert(Backend<kdb>::ordered,
+                      "Prefix scans need an ordered backend");
+        return PrefixScan(m_db.cursor(), prefix, from, end);
+    }
+
+    // The records of the object owner, with few of the objects whose id
+    // starts with its own in between.
+    PrefixScan object_scan(const std::string &owner) {
+        return scan(owner, std::string(), util::owner_end(owner));
+    }
+
+    // Applies ops in a single transaction. Removing a missing record isn't
+    // an error.
+    void apply(const WriteOpMap &ops) {
+        using namespace kyotocabinet;
+
+        if (ops.empty())
+            return;
+        check_writable();
+
+        std::lock_guard<std::mutex> lock(m_apply_mutex);
+        if (!m_db.begin_transaction()) {
+            throw std::runtime_error(std::string("Couldn't begin "
+                     "transaction: ") + m_db.error().message());
+        }
+
+        for (const auto &op : ops) {
+            bool done;
+            if (op.second.remove) {
+                done = m_db.remove(op.first) ||
+                       m_db.error().code() == BasicDB::Error::NOREC;
+            } else {
+                done = m_db.set(op.first,
+                                op_value(m_db, op.first, op.second));
+                if (done && m_filter)
+                    m_filter->insert(op.first);
+            }
+
+            if (!done) {
+                std::string message = m_db.error().message();
+                m_db.end_transaction(false);
+                throw std::runtime_error("Couldn't write " + op.first
+                                                + " (" + message + ")");
+            }
+        }
+
+        bool committed = m_db.end_transaction(true);
+        if (m_cache)
+            m_cache->invalidate(ops);
+        if (!committed) {
+            throw std::runtime_error(std::string("Couldn't commit "
+                    "transaction: ") + m_db.error().message());
+        }
+    }
+
+    const DatabaseOptions &options() const {
+        return m_options;
+    }
+
 protected:
+    void copy_records(const std::string &file) {
+        kdb dest;
+        Backend<kdb>::tune(dest, m_options);
+        if (!dest.open(file, kdb::OWRITER | kdb::OCREATE | kdb::OTRUNCATE)) {
+            throw std::runtime_error("Couldn't open file: " + file + " ("
+                                        + dest.error().message() + ")");
+        }
+
+        // An object's rows can be split by those of an id extending its
+        // own with a digit or punctuation. The whole object is copied when
+        // its first row comes up; objects split that way are remembered
+        // so their later rows are skipped.
+        std::unordered_set<std::string> split;
+        std::unique_ptr<typename kdb::Cursor> cur(m_db.cursor());
+        std::string key;
+        bool more = cur->jump() && cur->get_key(&key, false);
+        while (more) {
+            std::string owner = key.substr(0, util::owner_length(key.data(),
+                                                                 key.size()));
+            if (!split.count(owner) && copy_object(dest, file, owner))
+                split.insert(owner);
+
+            while ((more = cur->step() && cur->get_key(&key, false)) &&
+                   util::owner_length(key.data(), key.size()) == owner.size()
+                   && key.compare(0, owner.size(), owner) == 0) {}
+        }
+
+        if (!dest.close()) {
+            throw std::runtime_error("Couldn't close " + file + " ("
+                                      + dest.error().message() + ")");
+        }
+    }
+
+    // Copies the rows of owner to dest under its stripe; true if they're
+    // split by rows of other objects. An owner that isn't an IndexKey is a
+    // global index record, the only row it has.
+    bool copy_object(kdb &dest, const std::string &file,
+                                const std::string &owner) {
+        std::shared_lock<std::shared_mutex> lock(g_object_locks.at(owner));
+        if (owner.find(IndexSeparator::string()) == std::string::npos) {
+            std::string value;
+            if (m_db.get(owner, &value) && !dest.set(owner, value)) {
+                throw std::runtime_error("Couldn't write " + file + " ("
+                                          + dest.error().message() + ")");
+            }
+            return false;
+        }
+
+        bool foreign = false, split = false;
+        for (const auto &record : object_scan(owner)) {
+            if (util::owner_length(record.first.data(), record.first.size())
+                                                           != owner.size()) {
+                foreign = true;
+                continue;
+            }
+            split |= foreign;
+            if (!dest.set(record.first.data(), record.first.size(),
+                          record.second.data(), record.second.size())) {
+                throw std::runtime_error("Couldn't write " + file + " ("
+                                          + dest.error().message() + ")");
+            }
+        }
+        return split;
+    }
+
+    void check_writable() const {
+        if (read_only())
+            throw std::runtime_error("Database is read-only");
+    }
+
     kdb m_db;
+    DatabaseOptions m_options;
+    std::mutex m_apply_mutex;
+    std::unique_ptr<ObjectCache> m_cache;
+    std::unique_ptr<ExistenceFilter> m_filter;
+    std::unique_ptr<GroupCommitWriter<Database>> m_writer;
 };
 
 template<>
 class Database<NullDBBackend> {
 public:
-    void open(std::string file) {}
+    static constexpr bool ordered = true;
+    static constexpr bool persistent = false;
+
+    void open(std::string file, const DatabaseOptions &options = {}) {}
     void close() {}
     NullDBBackend &impl() {
         return m_db;
     }
+    void apply(const WriteOpMap &ops) {}
+    GroupCommitWriter<Database> *group_commit() {
+        return nullptr;
+    }
+    bool synchronize(bool hard = false) {
+        return true;
+    }
+    bool read_only() const {
+        return false;
+    }
+    ObjectCache *cache() {
+        return nullptr;
+    }
+    bool may_exist(const std::string &key) const {
+        return true;
+    }
+    std::shared_lock<std::shared_mutex> read_lock(std::shared_mutex &mutex) {
+        return std::shared_lock<std::shared_mutex>(mutex);
+    }
 
 protected:
     NullDBBackend m_db;
 };
 
+typedef Database<kyotocabinet::TreeDB> TreeDatabase;
+typedef Database<kyotocabinet::HashDB> HashDatabase;
+typedef Database<kyotocabinet::CacheDB> CacheDatabase;
+typedef Database<kyotocabinet::ProtoTreeDB> MemoryDatabase;
+
 }
 
 #endif
@@ -6,6 +6,8 @@
 #include <string>
 #include <memory>
 #include <vector>
+#include <string_view>
+#include <unordered_map>
 #include <stdexcept>
 #include <rapidjson/document.h>
 #include "database.hh"
@@ -23,6 +25,8 @@ namespace RPC {
 template<class Database>
 class DatamodelObject {
 public:
+    virtual ~DatamodelObject() {}
+
     virtual void get(const rapidjson::Document &desc) {};
     virtual rapidjson::Document describe() const {};
 
@@ -36,6 +40,10 @@ public:
 
     virtual std::vector<std::string> virtual_rpc_methods() const {};
     virtual std::string virtual_type() const {};
+
+    // empties the object for an object pool; its id is unset until one
+    // is assigned or generated
+    virtual void recycle() {}
 };
 
 template<class Database>
@@ -54,13 +62,19 @@ public:
         template<class> class ...Types_>
     class Foreach {
     public:
-        template <class Database_ = Database<>>
-        static DatamodelObject<Database_> *create(std::string type) {
-             if (T_<Database_>::type() == type)
-                return new T_<Database_>;
+        template <class Database_>
+        static void factories(std::vector<DatamodelObject<Database_> *(*)()>
+                                                                     &ret) {
+             ret.push_back(&make<Database_, T_<Database_>>);
+             if (sizeof...(Types_))
+                Foreach<Types_...>::factories(ret);
+        }
+
+        static void type_ids(std::unordered_map<std::string_view, int> &ret,
+                                                                int id = 0) {
+             ret.emplace(T_<Database<NullDBBackend>>::type(), id);
              if (sizeof...(Types_))
-                return Foreach<Types_...>::create(type);
-             throw inventory::exceptions::NoSuchType(type);
+                Foreach<Types_...>::type_ids(ret, id + 1);
         }
 
         static void *type_list(std::vector<std::string> &ret) {
@@ -70,9 +84,63 @@ public:
         }
     };
 
+    // Returns objects to a per-thread pool of their type once released.
+    template <class Database_>
+    class Recycler {
+    public:
+        Recycler(int type_id = 0)
+        : m_type_id(type_id) {}
+
+        void operator()(DatamodelObject<Database_> *object) const {
+            auto &pool = pools<Database_>()[m_type_id];
+            if (pool.size() >= kPoolSize) {
+                delete object;
+                return;
+            }
+            object->recycle();
+            pool.emplace_back(object);
+        }
+
+    private:
+        int m_type_id;
+    };
+
+    template <class Database_>
+    using Pooled = std::unique_ptr<DatamodelObject<Database_>,
+                                   Recycler<Database_>>;
+
+    static constexpr size_t kPoolSize = 16;
+
     template <class Database_ = Database<>>
-    static DatamodelObject<Database_> *create(std::string type) {
-        return Foreach<Types...>::template create<Database_>(type);
+    static DatamodelObject<Database_> *create(std::string_view type) {
+        return factories<Database_>()[checked_type_id(type)]();
+    }
+
+    // A pooled object of type, constructed only if the pool of this
+    // thread is empty. Assign or generate an id before use: a reused
+    // object has none.
+    template <class Database_ = Database<>>
+    static Pooled<Database_> acquire(std::string_view type) {
+        int id = checked_type_id(type);
+        auto &pool = pools<Database_>()[id];
+        if (pool.empty())
+            return Pooled<Database_>(factories<Database_>()[id](), id);
+
+        Pooled<Database_> object(pool.back().release(), id);
+        pool.pop_back();
+        return object;
+    }
+
+    // index of type in the datamodel, -1 if there's no such type
+    static int type_id(std::string_view type) {
+        static const std::unordered_map<std::string_view, int> ids = [] {
+            std::unordered_map<std::string_view, int> ids;
+            Foreach<Types...>::type_ids(ids);
+            return ids;
+        }();
+
+        auto it = ids.find(type);
+        return it == ids.end() ? -1 : it->second;
     }
 
     static std::vector<std::string> type_list() {
@@ -81,11 +149,39 @@ public:
         return ret;
     }
 
-    static bool type_exists(std::string type) {
-        for (const std::string &iter : type_list())
-            if (iter == type)
-                return true;
-        return false;
+    static bool type_exists(std::string_view type) {
+        return type_id(type) >= 0;
+    }
+
+private:
+    template <class Database_, class T>
+    static DatamodelObject<Database_> *make() {
+        return new T;
+    }
+
+    static int checked_type_id(std::string_view type) {
+        int id = type_id(type);
+        if (id < 0)
+            throw inventory::exceptions::NoSuchType(std::string(type));
+        return id;
+    }
+
+    template <class Database_>
+    static const std::vector<DatamodelObject<Database_> *(*)()> &factories() {
+        static const std::vector<DatamodelObject<Database_> *(*)()> ret = [] {
+            std::vector<DatamodelObject<Database_> *(*)()> ret;
+            Foreach<Types...>::template factories<Database_>(ret);
+            return ret;
+        }();
+        return ret;
+    }
+
+    template <class Database_>
+    static std::vector<std::vector<std::unique_ptr<DatamodelObject<Database_>>>>
+                                                                    &pools() {
+        thread_local std::vector<std::vector<std::unique_ptr<
+                   DatamodelObject<Database_>>>> pools(sizeof...(Types));
+        return pools;
     }
 };
 
@@ -0,0 +1,322 @@
+#ifndef LIBINV_EXISTENCE_FILTER_HH
+#define LIBINV_EXISTENCE_FILTER_HH
+#include <kcdb.h>
+#include <kcutil.h>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <fstream>
+#include <stdexcept>
+#include "key.hh"
+
+/* google coding style */
+
+namespace inventory {
+
+// Bloom filter with all bits of a key in one 512-bit block, so a lookup
+// touches a single cache line.
+class BlockedBloomFilter {
+public:
+    static constexpr size_t kBlockWords = 8;
+    static constexpr size_t kBitsPerKey = 10;
+    static constexpr int kProbes = 7;
+
+    BlockedBloomFilter(uint64_t capacity)
+    : m_capacity(capacity),
+      m_blocks((capacity * kBitsPerKey + 511) / 512),
+      m_words(m_blocks * kBlockWords) {
+        for (auto &word : m_words)
+            word.store(0, std::memory_order_relaxed);
+    }
+
+    void insert(uint64_t hash) {
+        std::atomic<uint64_t> *block = block_of(hash);
+        uint32_t h1 = hash, h2 = (hash >> 17) | 1;
+        for (int i = 0; i < kProbes; i++, h1 += h2) {
+            uint32_t bit = h1 & 511;
+            block[bit >> 6].fetch_or(uint64_t(1) << (bit & 63),
+                                     std::memory_order_relaxed);
+        }
+        m_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    bool may_contain(uint64_t hash) const {
+        const std::atomic<uint64_t> *block = block_of(hash);
+        uint32_t h1 = hash, h2 = (hash >> 17) | 1;
+        for (int i = 0; i < kProbes; i++, h1 += h2) {
+            uint32_t bit = h1 & 511;
+            if (!(block[bit >> 6].load(std::memory_order_relaxed) &
+                                      (uint64_t(1) << (bit & 63))))
+                return false;
+        }
+        return true;
+    }
+
+    bool full() const {
+        return m_count.load(std::memory_order_relaxed) >= m_capacity;
+    }
+
+    uint64_t capacity() const {
+        return m_capacity;
+    }
+
+    void save(std::ostream &out) const {
+        uint64_t header[3] = {m_capacity, m_count, m_blocks};
+        out.write(reinterpret_cast<const char *>(header), sizeof(header));
+        for (const auto &word : m_words) {
+            uint64_t value = word.load(std::memory_order_relaxed);
+            out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+        }
+    }
+
+    static std::unique_ptr<BlockedBloomFilter> load(std::istream &in) {
+        uint64_t header[3];
+        if (!in.read(reinterpret_cast<char *>(header), sizeof(header)))
+            return nullptr;
+
+        std::unique_ptr<BlockedBloomFilter> filter(
+                           new BlockedBloomFilter(header[0]));
+        if (filter->m_blocks != header[2])
+            return nullptr;
+        filter->m_count = header[1];
+        for (auto &word : filter->m_words) {
+            uint64_t value;
+            if (!in.read(reinterpret_cast<char *>(&value), sizeof(value)))
+                return nullptr;
+            word.store(value, std::memory_order_relaxed);
+        }
+        return filter;
+    }
+
+private:
+    std::atomic<uint64_t> *block_of(uint64_t hash) {
+        return &m_words[((hash >> 32) % m_blocks) * kBlockWords];
+    }
+
+    const std::atomic<uint64_t> *block_of(uint64_t hash) const {
+        return &m_words[((hash >> 32) % m_blocks) * kBlockWords];
+    }
+
+    const uint64_t m_capacity;
+    const uint64_t m_blocks;
+    std::atomic<uint64_t> m_count{0};
+    std::vector<std::atomic<uint64_t>> m_words;
+};
+
+// Per-type filters over the index records ("Type:id") of a Database,
+// answering "definitely absent" for most ids that were never committed.
+// Removed ids stay in the filter until it's rebuilt. A type's filter
+// grows by adding a stage of twice the capacity once the last one fills
+// up.
+//
+// The filters are saved next to the database file on close and marked
+// dirty while the database is open, so after a crash they're rebuilt
+// from the records.
+class ExistenceFilter {
+public:
+    static constexpr uint64_t kInitialCapacity = 1 << 14;
+
+    // Loads the filters saved beside a database file, or rebuilds them
+    // from its records. file is empty for in-memory databases.
+    template<class kdb>
+    void open(kdb &db, const std::string &file) {
+        m_file = file;
+        if (m_file.empty() || !load(m_file, db.count())) {
+            clear();
+            Builder builder(*this);
+            if (!db.iterate(&builder, false)) {
+                throw std::runtime_error(std::string("Couldn't build "
+                        "existence filter (") + db.error().message() + ")");
+            }
+        }
+        if (!m_file.empty())
+            mark_dirty(m_file);
+    }
+
+    // saves the filters as clean, before the database is closed
+    template<class kdb>
+    bool close(kdb &db) {
+        if (m_file.empty())
+            return true;
+        return save(m_file, db.count(), true);
+    }
+
+    // key is an IndexKey
+    bool may_contain(std::string_view key) const {
+        std::string_view type = type_of(key);
+        uint64_t hash = kyotocabinet::hashmurmur(key.data(), key.size());
+
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        auto it = m_types.find(std::string(type));
+        if (it == m_types.end())
+            return false;
+        for (const auto &stage : it->second) {
+            if (stage->may_contain(hash))
+                return true;
+        }
+        return false;
+    }
+
+    // records that aren't index records are ignored
+    void insert(std::string_view key) {
+        if (!index_record(key))
+            return;
+        std::string type(type_of(key));
+        uint64_t hash = kyotocabinet::hashmurmur(key.data(), key.size());
+
+        {
+            std::shared_lock<std::shared_mutex> lock(m_mutex);
+            auto it = m_types.find(type);
+            if (it != m_types.end() && !it->second.back()->full()) {
+                it->second.back()->insert(hash);
+                return;
+            }
+        }
+
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        Stages &stages = m_types[type];
+        if (stages.empty() || stages.back()->full()) {
+            uint64_t capacity = stages.empty() ? kInitialCapacity
+                                    : 2 * stages.back()->capacity();
+            stages.emplace_back(new BlockedBloomFilter(capacity));
+        }
+        stages.back()->insert(hash);
+    }
+
+    void clear() {
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        m_types.clear();
+    }
+
+    // filters the ids of type are spread over; a lookup probes each
+    size_t stages(const std::string &type) const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        auto it = m_types.find(type);
+        return it == m_types.end() ? 0 : it->second.size();
+    }
+
+    // records is the record count of the database, to detect files that
+    // were changed without us
+    bool save(const std::string &file, int64_t records, bool clean) const {
+        std::ofstream out(file, std::ios::binary | std::ios::trunc);
+        write_header(out, records, clean);
+
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        uint32_t types = m_types.size();
+        out.write(reinterpret_cast<const char *>(&types), sizeof(types));
+        for (const auto &pair : m_types) {
+            uint32_t size = pair.first.size();
+            uint32_t stages = pair.second.size();
+            out.write(reinterpret_cast<const char *>(&size), sizeof(size));
+            out.write(pair.first.data(), size);
+            out.write(reinterpret_cast<const char *>(&stages),
+                                                 sizeof(stages));
+            for (const auto &stage : pair.second)
+                stage->save(out);
+        }
+        return out.good();
+    }
+
+    // false if the file is missing, dirty or doesn't match the database
+    bool load(const std::string &file, int64_t records) {
+        std::ifstream in(file, std::ios::binary);
+        char magic[sizeof(kMagic)];
+        uint32_t clean;
+        int64_t saved_records;
+        if (!in.read(magic, sizeof(magic)) ||
+                std::memcmp(magic, kMagic, sizeof(kMagic)) ||
+                !in.read(reinterpret_cast<char *>(&clean), sizeof(clean)) ||
+                !in.read(reinterpret_cast<char *>(&saved_records),
+                                              sizeof(saved_records)) ||
+                !clean || saved_records != records) {
+            return false;
+        }
+
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        m_types.clear();
+        uint32_t types;
+        if (!in.read(reinterpret_cast<char *>(&types), sizeof(types)))
+            return false;
+        for (uint32_t i = 0; i < types; i++) {
+            uint32_t size, stages;
+            if (!in.read(reinterpret_cast<char *>(&size), sizeof(size)))
+                return false;
+            std::string type(size, '\0');
+            if (!in.read(&type[0], size) ||
+                    !in.read(reinterpret_cast<char *>(&stages),
+                                                  sizeof(stages))) {
+                return false;
+            }
+            for (uint32_t j = 0; j < stages; j++) {
+                auto stage = BlockedBloomFilter::load(in);
+                if (!stage)
+                    return false;
+                m_types[type].push_back(std::move(stage));
+            }
+        }
+        return true;
+    }
+
+    // keeps the filters but flags the file as not to be trusted
+    static bool mark_dirty(const std::string &file) {
+        std::fstream out(file, std::ios::binary | std::ios::in |
+                                                  std::ios::out);
+        if (!out)
+            return false;
+        uint32_t clean = 0;
+        out.seekp(sizeof(kMagic));
+        out.write(reinterpret_cast<const char *>(&clean), sizeof(clean));
+        return out.good();
+    }
+
+    static bool index_record(std::string_view key) {
+        return util::owner_length(key.data(), key.size()) == key.size() &&
+               key.find(IndexSeparator::string()[0]) != std::string_view::npos;
+    }
+
+private:
+    typedef std::vector<std::unique_ptr<BlockedBloomFilter>> Stages;
+
+    class Builder : public kyotocabinet::DB::Visitor {
+    public:
+        Builder(ExistenceFilter &filter)
+        : m_filter(filter) {}
+
+        const char *visit_full(const char *kbuf, size_t ksiz,
+                   const char *vbuf, size_t vsiz, size_t *sp) {
+            m_filter.insert(std::string_view(kbuf, ksiz));
+            return NOP;
+        }
+
+    private:
+        ExistenceFilter &m_filter;
+    };
+
+    static constexpr char kMagic[8] = {'L', 'I', 'B', 'I', 'N', 'V', 'B', 'F'};
+
+    static std::string_view type_of(std::string_view key) {
+        return key.substr(0, key.find(IndexSeparator::string()[0]));
+    }
+
+    static void write_header(std::ostream &out, int64_t records, bool clean) {
+        uint32_t flag = clean;
+        out.write(kMagic, sizeof(kMagic));
+        out.write(reinterpret_cast<const char *>(&flag), sizeof(flag));
+        out.write(reinterpret_cast<const char *>(&records), sizeof(records));
+    }
+
+    std::string m_file;
+    mutable std::shared_mutex m_mutex;
+    std::unordered_map<std::string, Stages> m_types;
+};
+
+}
+
+#endif
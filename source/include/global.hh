@@ -6,6 +6,7 @@
 #include <functional>
 #include <rapidjson/document.h>
 #include "rpc.hh"
+#include "database.hh"
 
 namespace inventory {
 
@@ -19,42 +20,40 @@ public:
     typedef std::function<void(SharedVector<Derived> &&)> GlobalIndexCb;
 
     void get(Database &db) {}
+    void get_lazy(Database &db) {}
+
+    void load_begin() {}
+
+    bool load(char separator, std::string_view path, std::string_view value) {
+        return false;
+    }
     void commit(Database &db) {
-        using namespace rapidjson;
-        Derived &derived = static_cast<Derived &>(*this);
-        Document jindex = get_index(db);
-
-        if (m_clear) {
-            for (rapidjson::Value::ValueIterator itr = jindex.Begin();
-                                         itr != jindex.End(); ++itr) {
-                if (itr->GetString() == derived.path().string()) {
-                    jindex.Erase(itr);
-                    break;
-                }
-            } 
-        } else {
-            bool found = false;
-            for (rapidjson::Value::ValueIterator itr = jindex.Begin();
-                                         itr != jindex.End(); ++itr) {
-                if (itr->GetString() == derived.path().string()) {
-                    found = true;
-                    break;
-                }
-            } 
-            if (!found) {
-                Value jindexkey;
-                std::string path = derived.path();
-                jindexkey.SetString(path.c_str(), jindex.GetAllocator());
-                jindex.PushBack(jindexkey, jindex.GetAllocator());
-            }
-        }
+        WriteBatch<Database> batch(db);
+        commit(db, batch);
+        batch.commit();
+        on_commit();
+    }
 
-        put_index(db, jindex);
+    // The index is one record per type, so the entry is added or erased
+    // when the batch is applied, from the stored index under its stripe.
+    void commit(Database &db, WriteBatch<Database> &batch) {
+        Derived &derived = static_cast<Derived &>(*this);
+        batch.lock(g_object_locks);
+        std::string path = derived.path();
+        bool clear = m_clear;
+        batch.merge(derived.type(), [path, clear](const std::string *stored) {
+            return update_index(stored, path, clear);
+        });
     }
+
     void clear() {
         m_clear = true;
     }
 
+    void reset() {
+        m_clear = false;
+    }
+
     static std::shared_ptr<RPC::ClientRequest> get_global_index(std::shared_ptr<
                                 RPC::ClientSession> session, GlobalIndexCb cb) {
         using namespace inventory::RPC;
@@ -101,7 +100,21 @@ public:
         Document jindex = get_index(db, &alloc);
         Value jindexv;
         jindexv.Swap(jindex);
-        return jindexv;
+        if (!call.session() || !call.session()->has_user())
+            return jindexv;
+
+        std::vector<IndexKey> keys;
+        for (const Value &jkey : jindexv.GetArray())
+            keys.emplace_back(jkey.GetString());
+        RPC::authorize_listing(db, call, keys);
+
+        Value jkeys(kArrayType);
+        for (const IndexKey &key : keys) {
+            Value jkey;
+            jkey.SetString(key.string().c_str(), alloc);
+            jkeys.PushBack(jkey, alloc);
+        }
+        return jkeys;
     }
 
     static const std::string &mixin_type() {
@@ -156,22 +169,48 @@ private:
 
         Document jindex(alloc);
         std::string index_repr;
-        if (db.impl().get(derived.type(), &index_repr))
+        bool found;
+        {
+            auto lock = db.read_lock(g_object_locks.at(derived.type()));
+            found = db.impl().get(derived.type(), &index_repr);
+        }
+        if (found)
             jindex.Parse(index_repr.c_str()); // TODO check parse error
         else
             jindex.SetArray();
         return jindex;
     }
 
-    void put_index(Database &db, rapidjson::Value &jindex) {
+    // Stored index with path added, or erased if clear. An index that
+    // doesn't parse is kept as it is.
+    static std::string update_index(const std::string *stored,
+                                    const std::string &path, bool clear) {
         using namespace rapidjson;
-        Derived &derived = static_cast<Derived &>(*this);
+
+        Document jindex;
+        if (stored) {
+            jindex.Parse(stored->c_str());
+            if (jindex.HasParseError() || !jindex.IsArray())
+                return *stored;
+        } else {
+            jindex.SetArray();
+        }
+
+        Value::ValueIterator itr = jindex.Begin();
+        while (itr != jindex.End() && path != itr->GetString())
+            ++itr;
+        if (clear && itr != jindex.End()) {
+            jindex.Erase(itr);
+        } else if (!clear && itr == jindex.End()) {
+            Value jindexkey;
+            jindexkey.SetString(path.c_str(), jindex.GetAllocator());
+            jindex.PushBack(jindexkey, jindex.GetAllocator());
+        }
 
         StringBuffer esb;
         PrettyWriter<rapidjson::StringBuffer> ewriter(esb);
         jindex.Accept(ewriter);
-
-        db.impl().set(derived.type(), esb.GetString());
+        return esb.GetString();
     }
 
     bool m_clear = false;
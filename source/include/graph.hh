@@ -0,0 +1,145 @@
+#ifndef LIBINV_GRAPH_HH
+#define LIBINV_GRAPH_HH
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <functional>
+#include <limits>
+#include "key.hh"
+#include "lock_table.hh"
+
+/* google coding style */
+
+namespace inventory {
+
+// Breadth-first expansion of the object graph from one object, over link
+// records and hierarchy-down records, reading only keys. Each level is
+// passed through a filter before it's reported and expanded, so objects a
+// caller can't see don't lead anywhere either. Expansion stops once the
+// result can be filled, and every record read counts against a budget, so
+// hub objects don't make a traversal unbounded.
+class GraphTraversal {
+public:
+    enum Edge {
+        LINK = 1,
+        DOWN = 2
+    };
+
+    struct Node {
+        IndexKey key;
+        IndexKey via;
+        int depth;
+        Edge edge;
+    };
+
+    typedef std::function<void(std::vector<IndexKey> &)> LevelFilter;
+
+    // records read per allowed node before a traversal is cut short, so a
+    // filter rejecting most of a level doesn't make it unbounded
+    static constexpr size_t kVisitFactor = 16;
+
+    int max_depth = 1;
+    int edges = LINK | DOWN;
+    // reported and expanded types; all if empty
+    std::unordered_set<std::string> types;
+    size_t limit = 1000;
+
+    // Nodes in order of discovery, the root left out. truncated is set
+    // when the result cap or the visit budget cut the traversal short.
+    template<class Database>
+    std::vector<Node> run(Database &db, const IndexKey &root,
+                          LevelFilter filter, bool *truncated) const {
+        std::vector<Node> result;
+        std::unordered_set<std::string> visited({root.string()});
+        std::vector<Node> frontier({{root, IndexKey(), 0, LINK}});
+        size_t budget = limit * kVisitFactor;
+        *truncated = false;
+
+        for (int depth = 1; depth <= max_depth && !frontier.empty();
+                                                            depth++) {
+            // unfiltered, one node past the cap shows the result is cut
+            size_t room = filter ? std::numeric_limits<size_t>::max()
+                                 : limit - result.size() + 1;
+            std::vector<Node> level;
+            bool cut = false;
+            for (const Node &node : frontier) {
+                if (edges & LINK)
+                    cut = !expand<LinkKeyView>(db, node, LinkKey::prefix(
+                                node.key.string()), LINK, visited, room,
+                                                         &budget, &level);
+                if (!cut && (edges & DOWN))
+                    cut = !expand<HierarchyDownKeyView>(db, node,
+                        HierarchyDownKey::prefix(node.key.string()), DOWN,
+                                         visited, room, &budget, &level);
+                if (cut)
+                    break;
+            }
+
+            if (filter)
+                apply(filter, &level);
+            if (result.size() + level.size() > limit) {
+                level.resize(limit - result.size());
+                cut = true;
+            }
+            result.insert(result.end(), level.begin(), level.end());
+            if (cut) {
+                *truncated = true;
+                break;
+            }
+            frontier = std::move(level);
+        }
+        return result;
+    }
+
+private:
+    // false when level holds room nodes or the budget ran out
+    template<class View, class Database>
+    bool expand(Database &db, const Node &node, const std::string &prefix,
+                Edge edge, std::unordered_set<std::string> &visited,
+                size_t room, size_t *budget, std::vector<Node> *level) const {
+        auto lock = db.read_lock(g_object_locks.at(node.key.string()));
+        for (const auto &record : db.scan(prefix)) {
+            if (!*budget)
+                return false;
+            (*budget)--;
+
+            View view(record.first);
+            if (!view.good())
+                continue;
+
+            std::string remote(view.remote_part());
+            if (!types.empty() &&
+                    !types.count(std::string(IndexKeyView(remote).type_part())))
+                continue;
+            if (!visited.insert(remote).second)
+                continue;
+            level->push_back({IndexKey(remote), node.key, node.depth + 1,
+                                                                   edge});
+            if (level->size() >= room)
+                return false;
+        }
+        return true;
+    }
+
+    static void apply(const LevelFilter &filter, std::vector<Node> *level) {
+        std::vector<IndexKey> keys;
+        keys.reserve(level->size());
+        for (const Node &node : *level)
+            keys.push_back(node.key);
+        filter(keys);
+
+        std::unordered_set<std::string> kept;
+        for (const IndexKey &key : keys)
+            kept.insert(key.string());
+        std::vector<Node> filtered;
+        for (Node &node : *level) {
+            if (kept.count(node.key.string()))
+                filtered.push_back(std::move(node));
+        }
+        *level = std::move(filtered);
+    }
+};
+
+}
+
+#endif
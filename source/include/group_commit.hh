@@ -0,0 +1,209 @@
+#ifndef LIBINV_GROUP_COMMIT_HH
+#define LIBINV_GROUP_COMMIT_HH
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <future>
+#include <exception>
+#include <stdexcept>
+#include <cstdint>
+#include "write_batch.hh"
+
+/* google coding style */
+
+namespace inventory {
+
+enum class SyncPolicy {
+    NONE,     // durable once applied; syncing is left to the OS
+    INTERVAL, // synchronize at most once per interval
+    BATCH     // synchronize after every merged transaction
+};
+
+// Writer stage for a Database: WriteBatches committed by many threads are
+// queued, merged into one transaction and synchronized according to the
+// SyncPolicy. Each submitter gets a Ticket which becomes ready when its
+// ops are applied and again when they're durable.
+template<class Database>
+class GroupCommitWriter {
+public:
+    struct Ticket {
+        std::future<void> applied;
+        std::future<void> durable;
+    };
+
+private:
+    struct Pending {
+        WriteOpMap ops;
+        std::promise<void> applied;
+        std::promise<void> durable;
+    };
+
+public:
+    GroupCommitWriter(Database &db, SyncPolicy policy,
+          std::chrono::milliseconds interval = std::chrono::milliseconds(0))
+    : m_db(db), m_policy(policy), m_interval(interval),
+      m_last_sync(std::chrono::steady_clock::now()) {
+        m_thread = std::thread(&GroupCommitWriter::writer_impl, this);
+    }
+
+    // Everything submitted so far is written and synchronized.
+    ~GroupCommitWriter() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cv.notify_one();
+        m_thread.join();
+    }
+
+    Ticket submit(const WriteOpMap &ops) {
+        Pending pending;
+        pending.ops = ops;
+
+        Ticket ticket = {
+            pending.applied.get_future(),
+            pending.durable.get_future()
+        };
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_queue.push_back(std::move(pending));
+        }
+        m_cv.notify_one();
+        return ticket;
+    }
+
+    SyncPolicy policy() const {
+        return m_policy;
+    }
+
+    // number of merged transactions written so far
+    uint64_t transactions() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_transactions;
+    }
+
+private:
+    void writer_impl() {
+        for (;;) {
+            std::deque<Pending> group;
+            bool stop;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                if (m_unsynced.empty() || m_policy != SyncPolicy::INTERVAL) {
+                    m_cv.wait(lock, [this] {
+                        return m_stop || !m_queue.empty();
+                    });
+                } else {
+                    m_cv.wait_until(lock, m_last_sync + m_interval, [this] {
+                        return m_stop || !m_queue.empty();
+                    });
+                }
+                group.swap(m_queue);
+                stop = m_stop;
+            }
+
+            if (!group.empty())
+                write_group(group);
+            if (sync_due(stop))
+                sync();
+            if (stop)
+                break;
+        }
+    }
+
+    // A failed merged transaction is retried one batch at a time, so only
+    // the batches that fail on their own report the error.
+    void write_group(std::deque<Pending> &group) {
+        WriteOpMap merged;
+        for (Pending &pending : group) {
+            for (const auto &op : pending.ops)
+                stage(merged, op.first, op.second);
+        }
+
+        try {
+            m_db.apply(merged);
+        } catch (...) {
+            if (group.size() == 1) {
+                fail(group.front(), std::current_exception());
+                return;
+            }
+            for (Pending &pending : group) {
+                try {
+                    m_db.apply(pending.ops);
+                } catch (...) {
+                    fail(pending, std::current_exception());
+                    continue;
+                }
+                count_transaction();
+                applied(pending);
+            }
+            return;
+        }
+
+        count_transaction();
+        for (Pending &pending : group)
+            applied(pending);
+    }
+
+    void count_transaction() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_transactions++;
+    }
+
+    void applied(Pending &pending) {
+        pending.applied.set_value();
+        if (m_policy == SyncPolicy::NONE)
+            pending.durable.set_value();
+        else
+            m_unsynced.push_back(std::move(pending.durable));
+    }
+
+    static void fail(Pending &pending, std::exception_ptr error) {
+        pending.applied.set_exception(error);
+        pending.durable.set_exception(error);
+    }
+
+    bool sync_due(bool stop) const {
+        if (m_unsynced.empty())
+            return false;
+        if (stop || m_policy == SyncPolicy::BATCH)
+            return true;
+        return std::chrono::steady_clock::now() >= m_last_sync + m_interval;
+    }
+
+    void sync() {
+        bool synced = m_db.synchronize(true);
+        for (std::promise<void> &durable : m_unsynced) {
+            if (synced) {
+                durable.set_value();
+            } else {
+                durable.set_exception(std::make_exception_ptr(
+                    std::runtime_error("Couldn't synchronize database")));
+            }
+        }
+        m_unsynced.clear();
+        m_last_sync = std::chrono::steady_clock::now();
+    }
+
+    Database &m_db;
+    const SyncPolicy m_policy;
+    const std::chrono::milliseconds m_interval;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<Pending> m_queue;
+    bool m_stop = false;
+    uint64_t m_transactions = 0;
+
+    // writer thread only
+    std::vector<std::promise<void>> m_unsynced;
+    std::chrono::steady_clock::time_point m_last_sync;
+    std::thread m_thread;
+};
+
+}
+
+#endif
@@ -6,28 +6,34 @@
 #include <string>
 #include <mutex>
 #include <shared_mutex>
+#include <unordered_set>
 #include <kcdb.h>
 #include <rapidjson/document.h>
 #include "key.hh"
 #include "database.hh"
+#include "lazy_state.hh"
 #include "rpc.hh"
 #include "exception.hh"
 #include "uuid.hh"
 #include "shared_wrapper.hh"
 #include "shared_vector.hh"
+#include "subtree.hh"
 
 namespace inventory {
 
-extern std::shared_mutex g_hierarchical_rwlock;
 template<class Database, class Derived>
 class Hierarchical : public RPC::MethodRoster<Database,
                      Hierarchical<Database, Derived>> {
     typedef Hierarchical<Database, Derived> self;
 
 public:
+    static constexpr size_t kDescendantPage = 100;
+    static constexpr size_t kMaxDescendantPage = 1000;
+
     template<class AssocObject>
     void operator+=(AssocObject &object) {
         Derived &derived = static_cast<Derived &>(*this);
+        static_cast<self &>(object).resolve();
 
         *this += object.path();
 
@@ -49,6 +55,8 @@ public:
     }
 
     void operator+=(const IndexKey &key) {
+        util::check_id(key.string());
+        resolve();
         m_down_ids.insert(key);
         m_add_down_ids.insert(key);
         m_remove_down_ids.erase(key);
@@ -57,6 +65,7 @@ public:
 
     template<class AssocObject>
     void operator-=(AssocObject &object) {
+        static_cast<self &>(object).resolve();
         *this -= object.path();
         object.m_up_id.clear();
     }
@@ -72,6 +81,7 @@ public:
     }
 
     void operator-=(const IndexKey &key) {
+        resolve();
         m_down_ids.erase(key);
         m_add_down_ids.erase(key);
         m_remove_down_ids.insert(key);
@@ -79,27 +89,49 @@ public:
     }
 
     void get(Database &db) {
-        std::shared_lock<std::shared_mutex> lock(g_hierarchical_rwlock);
         Derived &derived = static_cast<Derived &>(*this);
+        auto lock = db.read_lock(g_object_locks.at(derived.path().string()));
 
+        load_begin();
         HierarchyUpKey upkey(derived.path());
         std::string up_id;
-        db.impl().get(upkey, &up_id);
-        m_up_id.from_string(up_id);
+        if (db.impl().get(upkey, &up_id))
+            load(HierarchyUpSeparator::string()[0], upkey.string(), up_id);
 
-        std::unique_ptr<kyotocabinet::DB::Cursor> cur(db.impl().cursor());
-        if (!cur->jump(HierarchyDownKey::prefix(derived.path())))
-            return;
+        for (const auto &record : db.scan(HierarchyDownKey::prefix(
+                                                    derived.path()))) {
+            load(HierarchyDownSeparator::string()[0], record.first,
+                                                      record.second);
+        }
+        on_get();
+    }
 
-        std::string path, value;
-        while (cur->get(&path, &value, true)) {
-            HierarchyDownKey dkey(path);
-            if (!dkey.good() || dkey.local_part() != derived.path())
-                break;
+    void load_begin() {
+        m_lazy.cancel();
+        m_up_id.clear();
+        m_path.clear();
+    }
 
-            m_down_ids.insert(dkey.remote_part());
+    bool load(char separator, std::string_view path, std::string_view value) {
+        if (separator == HierarchyUpSeparator::string()[0]) {
+            m_path.assign(value);
+            m_up_id.from_string(std::string(value.substr(0,
+                                                  value.find(separator))));
+            return true;
         }
-        on_get();
+        if (separator != HierarchyDownSeparator::string()[0])
+            return false;
+
+        HierarchyDownKeyView dkey(path);
+        if (dkey.good())
+            m_down_ids.emplace(std::string(dkey.remote_part()));
+        return true;
+    }
+
+    // Binds to db without reading; the records are loaded on first
+    // access to the state.
+    void get_lazy(Database &db) {
+        m_lazy.defer(db);
     }
 
     void on_get() {
@@ -107,6 +139,7 @@ public:
     }
 
     void on_commit() {
+        recheck();
         m_add_down_ids.clear();
         m_remove_down_ids.clear();
         m_remove_dkeys.clear();
@@ -116,40 +149,70 @@ public:
     }
 
     void commit(Database &db) {
-        std::unique_lock<std::shared_mutex> lock(g_hierarchical_rwlock);
+        WriteBatch<Database> batch(db);
+        commit(db, batch);
+        batch.commit();
+        on_commit();
+    }
+
+    // The up record is always written, so a lazy state is loaded first.
+    // It holds the whole ancestor path; when that changes (the object was
+    // moved), the paths of everything below are rewritten in this batch.
+    // The paths are read now and written when the batch is applied, so
+    // the batch holds the hierarchy lock in between: exclusively when a
+    // subtree is rewritten, shared when only leaves are added or removed.
+    void commit(Database &db, WriteBatch<Database> &batch) {
         Derived &derived = static_cast<Derived &>(*this);
+        resolve();
 
+        bool exclusive = moves();
+        for (const auto *ids : {&m_add_down_ids, &m_remove_down_ids}) {
+            for (const IndexKey &p : *ids) {
+                if (!exclusive)
+                    exclusive = has_children(db, p);
+            }
+        }
+        m_recheck_db = exclusive ? nullptr : &db;
+        batch.hold(g_hierarchy_lock, exclusive);
+        batch.lock(g_object_locks);
         HierarchyUpKey upkey(derived.path());
+        std::string path;
         if (m_up_id) {
-            db.impl().set(upkey, m_up_id);
+            path = HierarchyPath::child_path(db, m_up_id);
+            batch.set(upkey, path);
         } else {
-            db.impl().remove(upkey);
+            batch.remove(upkey);
         }
 
+        if (path != m_path) {
+            std::set<IndexKey> skip(m_remove_down_ids);
+            skip.insert(m_add_down_ids.begin(), m_add_down_ids.end());
+            update_paths(db, batch, derived.path(), path, skip);
+        }
+        m_path = path;
+
+        std::string down_path = derived.path().string() +
+                                HierarchyUpSeparator::string() + path;
         for (const IndexKey &p : m_add_down_ids) {
             HierarchyDownKey dkey({derived.path(), p.string()});
             HierarchyUpKey ukey(p.string());
 
-            db.impl().set(ukey, derived.path());
-            db.impl().set(dkey, "");
+            batch.set(ukey, down_path);
+            batch.set(dkey, "");
+            update_paths(db, batch, p, down_path);
         }
 
         for (const IndexKey &p : m_remove_down_ids) {
             HierarchyDownKey dkey({derived.path(), p.string()});
             HierarchyUpKey ukey(p.string());
 
-            if (!db.impl().remove(dkey))
-                throw std::runtime_error("Couldn't remove keys");
-            if (!db.impl().remove(ukey))
-                throw std::runtime_error("Couldn't remove keys");
-        }
-
-        for (const HierarchyDownKey &dkey : m_remove_dkeys) {
-             if (!db.impl().remove(dkey))
-                throw std::runtime_error("Couldn't remove keys");           
+            batch.remove(dkey);
+            batch.remove(ukey);
+            update_paths(db, batch, p, "");
         }
 
-        on_commit();
+        for (const HierarchyDownKey &dkey : m_remove_dkeys)
+            batch.remove(dkey);
     }
 
     std::unique_ptr<JSONRPC::SingleRequest> build_update_request(
@@ -209,65 +272,76 @@ public:
     }
 
     void set_up_id(const IndexKey &key) {
+        util::check_id(key.string());
+        resolve();
         m_up_id = key;
         m_modified = true;
     }
 
     std::string up_id() {
+        resolve();
         return m_up_id;
     }
 
     bool is_root() const {
+        resolve();
         return m_up_id.empty();
     }
 
     bool empty() const {
+        resolve();
         return m_down_ids.empty();
     }
 
     void clear_up() {
+        resolve();
         m_up_id.clear();
         m_modified = true;
     }
 
     void clear_down() {
+        resolve();
         m_remove_down_ids = m_down_ids;
         m_down_ids.clear();
         m_modified = true;
     }
 
     Shared<Derived> up(Database &db) {
+        resolve();
         Shared<Derived> obj;
         obj->get(db, m_up_id.id_part());
         return obj;
     }
 
     Shared<Derived> up() {
+        resolve();
         Shared<Derived> obj(m_up_id);
         return obj;
     }
 
     std::set<IndexKey> down_ids() {
+        resolve();
         return m_down_ids;
     }
 
+    // Ancestors, nearest first. One point read of the up record, plus one
+    // per level above a record written before ancestor paths were kept.
     std::vector<IndexKey> upward_ids(Database &db, std::vector<IndexKey>
                                                             ovec = {}) {
-        get(db);
-        if (m_up_id) {
-            ovec.push_back(m_up_id);
-
-            Shared<Derived> up_ = up(db);
-            up_->upward_ids(db, ovec);
-        }
+        Derived &derived = static_cast<Derived &>(*this);
+        HierarchyPath::ancestors(db, derived.path(), &ovec);
         return ovec;
     }
 
     rapidjson::Value upward_ids(Database &db, rapidjson::Document
                                         ::AllocatorType &alloc) {
-        std::vector<IndexKey> up_ids = upward_ids(db);
+        return ids_repr(upward_ids(db), alloc);
+    }
+
+    static rapidjson::Value ids_repr(const std::vector<IndexKey> &ids,
+                              rapidjson::Document::AllocatorType &alloc) {
         rapidjson::Value jids(rapidjson::kArrayType);
-        for (const IndexKey &key : up_ids) {
+        for (const IndexKey &key : ids) {
             rapidjson::Value jid;
             jid.SetString(key.string().c_str(), alloc);
             jids.PushBack(jid, alloc);
@@ -276,19 +350,14 @@ public:
     }
 
     SharedVector<Derived> down(Database &db) {
-        // TODO fix?
-        std::vector<Derived> result;
         std::set<IndexKey> dids = down_ids();
-        for (const IndexKey &key : dids) {
-            Derived obj(db);
-            obj.get(db, key.id_part());
-            result.push_back(obj);
-        }
-        return result;
+        return SharedVector<Derived>::load(db,
+            std::vector<IndexKey>(dids.begin(), dids.end()));
     }
 
     // just ids, use SharedVector::get to get full repr 
     SharedVector<Derived> down() {
+        resolve();
         SharedVector<Derived> result;
         for (const IndexKey &key : m_down_ids) {
             Shared<Derived> obj(key);
@@ -300,7 +369,8 @@ public:
     static const std::vector<RPC::Method<Database, self>> &methods() {
         static const std::vector<RPC::Method<Database, self>> ret({
             RPC::Method<Database, self>("hierarchical.update", &self::rpc_update),
-            RPC::Method<Database, self>("hierarchical.hierarchy", &self::rpc_hierarchy)
+            RPC::Method<Database, self>("hierarchical.hierarchy", &self::rpc_hierarchy),
+            RPC::Method<Database, self>("hierarchical.descendants", &self::rpc_descendants)
         });
         return ret;
     }
@@ -331,7 +401,98 @@ public:
         if (!derived.exists(db))
             throw exceptions::NoSuchObject(derived.type(), derived.id());
 
-        return upward_ids(db, alloc);
+        std::vector<IndexKey> up_ids = upward_ids(db);
+        RPC::authorize_listing(db, call, up_ids);
+        return ids_repr(up_ids, alloc);
+    }
+
+    // Everything below the object, depth first. params: cursor (from the
+    // previous page), limit, min_depth and max_depth (children are at
+    // depth 1) and a types filter. Returns {"nodes": [{id, depth}...],
+    // "cursor": next page or null}.
+    rapidjson::Value rpc_descendants(Database &db, const RPC::SingleCall &call,
+                                   rapidjson::Document::AllocatorType &alloc) {
+        using namespace rapidjson;
+        Derived &derived = static_cast<Derived &>(*this);
+        derived.rpc_get_index(call);
+        if (!derived.exists(db))
+            throw exceptions::NoSuchObject(derived.type(), derived.id());
+
+        const RPC::ObjectCallParams params(call);
+        SubtreeScan scan;
+        scan.limit = kDescendantPage;
+        if (params.has_member("limit")) {
+            const Value &jlimit = params["limit"];
+            if (!jlimit.IsUint() || !jlimit.GetUint())
+                throw RPC::exceptions::InvalidParameters("bad \"limit\"");
+            scan.limit = std::min<size_t>(jlimit.GetUint(), kMaxDescendantPage);
+        }
+        if (params.has_member("min_depth")) {
+            const Value &jdepth = params["min_depth"];
+            if (!jdepth.IsUint() || !jdepth.GetUint() ||
+                    jdepth.GetUint() > SubtreeScan::kMaxDepth)
+                throw RPC::exceptions::InvalidParameters("bad \"min_depth\"");
+            scan.min_depth = jdepth.GetUint();
+        }
+        if (params.has_member("max_depth")) {
+            const Value &jdepth = params["max_depth"];
+            if (!jdepth.IsUint() || jdepth.GetUint() <
+                    static_cast<unsigned>(scan.min_depth))
+                throw RPC::exceptions::InvalidParameters("bad \"max_depth\"");
+            scan.max_depth = std::min<unsigned>(jdepth.GetUint(),
+                                                SubtreeScan::kMaxDepth);
+        }
+        if (params.has_member("types")) {
+            const Value &jtypes = params["types"];
+            if (!jtypes.IsArray())
+                throw RPC::exceptions::InvalidParameters("bad \"types\"");
+            for (const Value &jtype : jtypes.GetArray()) {
+                if (!jtype.IsString())
+                    throw RPC::exceptions::InvalidParameters("bad \"types\"");
+                scan.types.insert(jtype.GetString());
+            }
+        }
+        std::string cursor;
+        if (params.has_member("cursor")) {
+            const Value &jcursor = params["cursor"];
+            if (!jcursor.IsString())
+                throw RPC::exceptions::InvalidParameters("bad \"cursor\"");
+            cursor = jcursor.GetString();
+        }
+
+        std::vector<SubtreeScan::Node> nodes;
+        std::string next;
+        if (!scan.page(db, derived.path(), cursor, &nodes, &next))
+            throw RPC::exceptions::InvalidParameters("bad \"cursor\"");
+
+        std::vector<IndexKey> keys;
+        keys.reserve(nodes.size());
+        for (const SubtreeScan::Node &node : nodes)
+            keys.push_back(node.key);
+        RPC::authorize_listing(db, call, keys);
+        std::unordered_set<std::string> kept;
+        for (const IndexKey &key : keys)
+            kept.insert(key.string());
+
+        Value jnodes(kArrayType);
+        for (const SubtreeScan::Node &node : nodes) {
+            if (!kept.count(node.key.string()))
+                continue;
+            Value jnode(kObjectType);
+            Value jid;
+            jid.SetString(node.key.string().c_str(), alloc);
+            jnode.AddMember("id", jid, alloc);
+            jnode.AddMember("depth", node.depth, alloc);
+            jnodes.PushBack(jnode, alloc);
+        }
+        Value jnext(kNullType);
+        if (!next.empty())
+            jnext.SetString(next.c_str(), alloc);
+
+        Value jresult(kObjectType);
+        jresult.AddMember("nodes", jnodes, alloc);
+        jresult.AddMember("cursor", jnext, alloc);
+        return jresult;
     }
 
     static const std::string &mixin_type() {
@@ -340,6 +501,7 @@ public:
     }
 
     void from_repr(const rapidjson::Value &object) {
+        resolve();
         if (!object.IsObject())
             throw exceptions::InvalidRepr("repr is not a json object");
 
@@ -357,12 +519,14 @@ public:
     }
 
     rapidjson::Value repr(rapidjson::Document::AllocatorType &alloc) const {
+        resolve();
         rapidjson::Value rarr(rapidjson::kObjectType);
         repr(rarr, alloc);
         return rarr;
     }
 
     rapidjson::Document repr() const {
+        resolve();
         rapidjson::Document rdoc(rapidjson::kObjectType);
         repr(rdoc, rdoc.GetAllocator());
         return rdoc;
@@ -374,6 +538,19 @@ public:
         m_modified = true;
     }
 
+    // empties the state for reuse by an object pool
+    void reset() {
+        m_lazy.cancel();
+        m_up_id.clear();
+        m_path.clear();
+        m_down_ids.clear();
+        m_add_down_ids.clear();
+        m_remove_down_ids.clear();
+        m_remove_dkeys.clear();
+        m_modified = false;
+        m_db_backed = false;
+    }
+
     bool modified() const {
         return m_modified;
     }
@@ -391,6 +568,95 @@ public:
     }
 
 private:
+    void resolve() const {
+        if (m_lazy.pending())
+            const_cast<self &>(*this).get(m_lazy.take());
+    }
+
+    // Whether the commit changes the object's own path, going by the up
+    // record last read or written.
+    bool moves() const {
+        if (!m_up_id)
+            return !m_path.empty();
+
+        const char separator = HierarchyUpSeparator::string()[0];
+        return m_path.empty() || m_path.back() != separator ||
+               m_path.compare(0, m_path.find(separator),
+                              m_up_id.string()) != 0;
+    }
+
+    static bool has_children(Database &db, const IndexKey &key) {
+        auto lock = db.read_lock(g_object_locks.at(key.string()));
+        auto records = db.scan(HierarchyDownKey::prefix(key.string()));
+        return records.begin() != records.end();
+    }
+
+    // A leaf added or removed under the shared lock may have been given
+    // children by a commit that read its old path and was applied first.
+    // Such a subtree is rewritten from the path now stored.
+    void recheck() {
+        Database *db = m_recheck_db;
+        m_recheck_db = nullptr;
+        if (!db)
+            return;
+
+        for (const auto *ids : {&m_add_down_ids, &m_remove_down_ids}) {
+            for (const IndexKey &p : *ids) {
+                if (!has_children(*db, p))
+                    continue;
+
+                std::unique_lock<std::shared_mutex> lock(g_hierarchy_lock);
+                WriteBatch<Database> batch(*db);
+                batch.lock(g_object_locks);
+                std::string path;
+                {
+                    auto read = db->read_lock(g_object_locks.at(p.string()));
+                    HierarchyUpKey upkey(p.string());
+                    db->impl().get(upkey, &path);
+                }
+                update_paths(*db, batch, p, path);
+                batch.commit();
+            }
+        }
+    }
+
+    // Rewrites the up records in the subtree under key, whose own up record
+    // now holds path. Children of key in skip are left out.
+    static void update_paths(Database &db, WriteBatch<Database> &batch,
+                             const IndexKey &key, const std::string &path,
+                             const std::set<IndexKey> &skip = {}) {
+        std::vector<std::pair<std::string, std::string>> stack({{key.string(),
+                                                                 path}});
+        std::unordered_set<std::string> visited({key.string()});
+        while (!stack.empty()) {
+            std::string parent = std::move(stack.back().first);
+            std::string down_path = parent + HierarchyUpSeparator::string() +
+                                    stack.back().second;
+            stack.pop_back();
+
+            std::vector<std::string> children;
+            {
+                auto lock = db.read_lock(g_object_locks.at(parent));
+                for (const auto &record : db.scan(HierarchyDownKey::prefix(
+                                                                 parent))) {
+                    HierarchyDownKeyView dkey(record.first);
+                    if (dkey.good())
+                        children.emplace_back(dkey.remote_part());
+                }
+            }
+
+            for (std::string &child : children) {
+                if (parent == key.string() && skip.count(IndexKey(child)))
+                    continue;
+                if (!visited.insert(child).second)
+                    continue;
+                HierarchyUpKey ukey(child);
+                batch.set(ukey, down_path);
+                stack.emplace_back(std::move(child), down_path);
+            }
+        }
+    }
+
     void repr(rapidjson::Value &robj, rapidjson::Document::AllocatorType
                                                          &alloc) const {
         if (m_up_id) {
@@ -420,7 +686,12 @@ private:
                 throw exceptions::InvalidRepr("down_ids member is not a "
                                                                "string");
             }
-            *this += IndexKey(v.GetString());
+            std::string key = v.GetString();
+            if (util::owner_length(key.data(), key.size()) != key.size()) {
+                throw exceptions::InvalidRepr("down_ids member holds a "
+                                                           "separator");
+            }
+            *this += IndexKey(key);
         }
     }
 
@@ -454,16 +725,24 @@ private:
     void set_up_id(const rapidjson::Value &jup_id) {
         if (!jup_id.IsString())
             throw exceptions::InvalidRepr("up_id is not a string");
-        m_up_id.from_string(jup_id.GetString());
+        std::string up_id = jup_id.GetString();
+        if (util::owner_length(up_id.data(), up_id.size()) != up_id.size())
+            throw exceptions::InvalidRepr("up_id holds a separator");
+        m_up_id.from_string(up_id);
     }
 
     IndexKey m_up_id;
+    // up record value as last read or written
+    std::string m_path;
     std::set<IndexKey> m_down_ids;
     std::set<IndexKey> m_add_down_ids;
     std::set<IndexKey> m_remove_down_ids;
     std::set<HierarchyDownKey> m_remove_dkeys;
     bool m_modified = false;
     bool m_db_backed = false;
+    LazyState<Database> m_lazy;
+    // set by a commit under the shared hierarchy lock
+    Database *m_recheck_db = nullptr;
 };
 
 }
@@ -74,6 +74,7 @@ public:
     : ServerSession(static_cast<Server *>(server)),
       m_connection(connection) {
         m_handle = handle;
+        mp_user = std::make_unique<User>(g_authorizer.user(handle));
     }
 
     virtual void terminate();
@@ -5,6 +5,7 @@
 #include <uuid/uuid.h>
 #include "key.hh"
 #include "uuid.hh"
+#include "database.hh"
 
 /* google coding style */
 
@@ -43,19 +44,44 @@ public:
     }
 
     void commit(Database &db) {
-        if (!db.impl().set(path(), ""))
-            throw std::runtime_error("Couldn't set kv");
+        WriteBatch<Database> batch(db);
+        commit(db, batch);
+        batch.commit();
+    }
+
+    void commit(Database &db, WriteBatch<Database> &batch) {
+        commit(db, batch, std::string());
+    }
+
+    // header: the index record's value, see ObjectHeader
+    void commit(Database &db, WriteBatch<Database> &batch,
+                                 const std::string &header) {
+        batch.set(path(), header);
+    }
+
+    // header computed from the stored one at apply time
+    void commit(Database &db, WriteBatch<Database> &batch,
+                                 WriteOp::Merge header) {
+        batch.merge(path(), std::move(header));
     }
 
     bool exists(Database &db) {
         Derived &index_impl = static_cast<Derived &>(*this);
-        return db.impl().check(index_impl.path()) != -1;
+        IndexKey key = index_impl.path();
+        if (!db.may_exist(key))
+            return false;
+        return db.impl().check(key) != -1;
     }
 
     bool remove(Database &db) {
         Derived &index_impl = static_cast<Derived &>(*this);
         return db.impl().remove(index_impl.path()) != -1;
     }
+
+    void remove(Database &db, WriteBatch<Database> &batch) {
+        Derived &index_impl = static_cast<Derived &>(*this);
+        batch.remove(index_impl.path());
+    }
 };
 
 template<class Database, class Derived>
@@ -75,6 +101,7 @@ public:
     }
 
     void assign_id(std::string id) {
+        util::check_id(id);
         m_id = id;
         m_generated_id = false;
     }
@@ -98,12 +125,18 @@ public:
         return m_generated_id;
     }
 
+    void reset_id() {
+        m_id.clear();
+        m_generated_id = false;
+    }
+
 protected:
     void id_from_path(IndexKey path) {
-        m_id = path.id_part();
+        id_from_string(path.id_part());
     }
 
     void id_from_string(std::string id) {
+        util::check_id(id);
         m_id = id;
     }
 
@@ -159,12 +192,18 @@ public:
         return m_generated_id;
     }
 
+    void reset_id() {
+        m_uuid.clear();
+        m_generated_id = false;
+    }
+
 protected:
     void id_from_path(IndexKey path) {
         id_from_string(path.id_part());
     }
 
     void id_from_string(std::string uuid) {
+        util::check_id(uuid);
         m_uuid = uuid;
         // TODO check and throw bad uuid
     }
@@ -216,6 +255,11 @@ public:
         return m_generated_id;
     }
 
+    void reset_id() {
+        uuid_clear(m_uuid);
+        m_generated_id = false;
+    }
+
 protected:
     void id_from_path(IndexKey path) {
         id_from_string(path.id_part());
@@ -147,6 +147,12 @@ public:
         validate(*m_jval);
     }
 
+    // parses into a document allocating from alloc
+    void parse(rapidjson::Document::AllocatorType *alloc) {
+        alloc_document(rapidjson::kNullType, alloc);
+        parse();
+    }
+
 protected:
     std::string m_text;
 };
@@ -466,6 +472,9 @@ public:
     BatchResponse()
     : ResponseBase(rapidjson::kArrayType) {}
 
+    BatchResponse(rapidjson::Document::AllocatorType *alloc)
+    : ResponseBase(rapidjson::kArrayType, alloc) {}
+
     // Converting from a generic, just-parsed Response instance.
     BatchResponse(Response &&resp)
     : ResponseBase(std::move(resp)) {
@@ -1,10 +1,14 @@
 #ifndef LIBINV_KEY_HH
 #define LIBINV_KEY_HH
-#include <vector>
+#include <cstdint>
+#include <cstring>
 #include <initializer_list>
 #include <string>
-#include <boost/tokenizer.hpp>
-#include <boost/algorithm/string/join.hpp>
+#include <string_view>
+#include <stdexcept>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 /* google coding style */
 
@@ -52,6 +56,214 @@ public:
     }
 };
 
+namespace util {
+    // Every record of an object starts with its IndexKey, followed by
+    // the separator of the record kind. Global index records have no
+    // separator at all.
+    inline size_t owner_length(const char *key, size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            switch (key[i]) {
+            case '.':
+            case '*':
+            case '%':
+            case '<':
+            case '>':
+                return i;
+            }
+        }
+        return size;
+    }
+
+    // Bound past the records of owner: every separator sorts before '?',
+    // so only ids extending owner by a digit or punctuation sort between.
+    inline std::string owner_end(const std::string &owner) {
+        return owner + '?';
+    }
+
+    // An id holding a record separator would make the records of one
+    // object look like those of another.
+    inline void check_id(const std::string &id) {
+        if (owner_length(id.data(), id.size()) != id.size())
+            throw std::runtime_error("Bad id: " + id);
+    }
+
+    // offset of the first c in data, or size
+    inline size_t find_char(const char *data, size_t size, char c) {
+        size_t i = 0;
+#if defined(__AVX2__)
+        const __m256i needle32 = _mm256_set1_epi8(c);
+        for (; i + 32 <= size; i += 32) {
+            __m256i block = _mm256_loadu_si256(
+                    reinterpret_cast<const __m256i *>(data + i));
+            uint32_t mask = _mm256_movemask_epi8(
+                    _mm256_cmpeq_epi8(block, needle32));
+            if (mask)
+                return i + __builtin_ctz(mask);
+        }
+#endif
+#if defined(__SSE2__)
+        const __m128i needle16 = _mm_set1_epi8(c);
+        for (; i + 16 <= size; i += 16) {
+            __m128i block = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i *>(data + i));
+            uint32_t mask = _mm_movemask_epi8(
+                    _mm_cmpeq_epi8(block, needle16));
+            if (mask)
+                return i + __builtin_ctz(mask);
+        }
+#endif
+        for (; i < size; i++) {
+            if (data[i] == c)
+                return i;
+        }
+        return size;
+    }
+}
+
+// Non-owning tokenized view of a key, for scan loops. Tokens are views
+// into the viewed bytes, so the key must outlive it. Empty tokens are
+// skipped.
+template<class S>
+class KeyView {
+public:
+    typedef S Separator;
+
+    static constexpr int kInlineTokens = 4;
+
+    KeyView() {}
+
+    KeyView(std::string_view path)
+    : m_path(path) {
+        const char separator = Separator::string()[0];
+        size_t pos = 0;
+        while (pos < path.size()) {
+            size_t end = pos + util::find_char(path.data() + pos,
+                                        path.size() - pos, separator);
+            if (end > pos) {
+                if (m_elements < kInlineTokens)
+                    m_tokens[m_elements] = path.substr(pos, end - pos);
+                m_elements++;
+            }
+            pos = end + 1;
+        }
+    }
+
+    std::string_view operator[](int n) const {
+        if (n >= m_elements)
+            throw std::out_of_range("No such token");
+        if (n < kInlineTokens)
+            return m_tokens[n];
+        return KeyView(m_path.substr(m_tokens[kInlineTokens - 1].data() +
+                  m_tokens[kInlineTokens - 1].size() - m_path.data()))
+                                                  [n - kInlineTokens];
+    }
+
+    std::string_view view() const {
+        return m_path;
+    }
+
+    std::string string() const {
+        return std::string(m_path);
+    }
+
+    int elements() const {
+        return m_elements;
+    }
+
+    bool empty() const {
+        return !m_elements;
+    }
+
+    bool good() const {
+        return m_elements == 2;
+    }
+
+    bool operator==(const KeyView &k) const {
+        return m_path == k.m_path;
+    }
+
+    bool operator!=(const KeyView &k) const {
+        return m_path != k.m_path;
+    }
+
+    bool operator<(const KeyView &k) const {
+        return m_path < k.m_path;
+    }
+
+protected:
+    std::string_view m_path;
+    std::string_view m_tokens[kInlineTokens];
+    int m_elements = 0;
+};
+
+// record keys as seen by the scan loops of the mixins
+class IndexKeyView : public KeyView<IndexSeparator> {
+public:
+    using KeyView::KeyView;
+
+    std::string_view type_part() const {
+        return (*this)[0];
+    }
+
+    std::string_view id_part() const {
+        return (*this)[1];
+    }
+};
+
+class AttributeKeyView : public KeyView<AttributeSeparator> {
+public:
+    using KeyView::KeyView;
+
+    std::string_view container_part() const {
+        return (*this)[0];
+    }
+
+    std::string_view attribute_part() const {
+        return (*this)[1];
+    }
+};
+
+class LinkKeyView : public KeyView<LinkSeparator> {
+public:
+    using KeyView::KeyView;
+
+    std::string_view local_part() const {
+        return (*this)[0];
+    }
+
+    std::string_view remote_part() const {
+        return (*this)[1];
+    }
+};
+
+class HierarchyDownKeyView : public KeyView<HierarchyDownSeparator> {
+public:
+    using KeyView::KeyView;
+
+    std::string_view local_part() const {
+        return (*this)[0];
+    }
+
+    std::string_view remote_part() const {
+        return (*this)[1];
+    }
+};
+
+class ModeKeyView : public KeyView<ModeSeparator> {
+public:
+    using KeyView::KeyView;
+
+    std::string_view path_part() const {
+        return (*this)[0];
+    }
+
+    std::string_view handle_part() const {
+        return (*this)[1];
+    }
+};
+
+// Owning key. Holds the joined string, tokens are split on demand and
+// keys compare as bytes.
 template<class S>
 class Key {
 public:
@@ -59,22 +271,23 @@ public:
 
     Key() {}
 
-    Key(std::string path) {
-        boost::char_separator<char> bsep(Separator::string());
-        boost::tokenizer<boost::char_separator<char>> tokens(path, bsep);
-        for (const std::string &t : tokens)
-            m_path.push_back(t);
-    }
+    Key(std::string path)
+    : m_key(std::move(path)) {}
 
     Key(std::initializer_list<std::string> tokens) {
-        m_path.insert(m_path.end(), tokens);
+        for (const std::string &t : tokens) {
+            if (&t != tokens.begin())
+                m_key.append(Separator::string());
+            m_key.append(t);
+        }
     }
 
     bool compare(Key &p, int upto) {
         if (Separator::string() != p.Separator::string())
             return false;
+        KeyView<S> view(m_key), pview(p.m_key);
         for (int i = 0; i < upto; i++)
-            if ((*this)[i] != p[i])
+            if (view[i] != pview[i])
                 return false;
         return true;
     }
@@ -83,47 +296,48 @@ public:
         return string();
     }
 
-    std::string string() const  {
-        return boost::algorithm::join(m_path, Separator::string());
+    const std::string &string() const  {
+        return m_key;
+    }
+
+    KeyView<S> view() const {
+        return KeyView<S>(m_key);
     }
 
     std::string operator[](int n) const {
-        if (n >= m_path.size())
-            throw std::out_of_range("No such token");
-        return m_path[n];
+        return std::string(view()[n]);
     }
 
     bool operator==(const Key<S> &k) const {
-        return m_path == k.m_path;
+        return m_key == k.m_key;
     }
 
     bool operator!=(const Key<S> &k) const {
         return !operator==(k);
     }
 
-    // TODO optimize
     bool operator<(const Key<S> &k) const {
-        return m_path < k.m_path;
+        return m_key < k.m_key;
     }
 
     bool operator>(const Key<S> &k) const {
-        return m_path > k.m_path;
+        return m_key > k.m_key;
     }
 
     void clear() {
-        m_path.clear();
+        m_key.clear();
     }
 
     int elements() const {
-        return m_path.size();
+        return view().elements();
     }
 
     bool empty() const {
-        return !elements();
+        return m_key.empty();
     }
 
     operator bool() const {
-        return elements();
+        return !empty();
     }
 
     void from_string(std::string s) {
@@ -131,7 +345,13 @@ public:
     }
 
 protected:
-    std::vector<std::string> m_path;
+    void push_back(const std::string &token) {
+        if (!m_key.empty())
+            m_key.append(Separator::string());
+        m_key.append(token);
+    }
+
+    std::string m_key;
 };
 
 class IndexKey : public Key<IndexSeparator> {
@@ -153,7 +373,7 @@ public:
     }
 
     bool good() const {
-        return m_path.size() == 2;
+        return elements() == 2;
     }
 };
 
@@ -176,7 +396,7 @@ public:
     }
 
     bool good() const {
-        return m_path.size() == 2;
+        return elements() == 2;
     }
 
     static std::string prefix(std::string local_part) {
@@ -205,7 +425,7 @@ public:
     }
 
     bool good() const {
-        return m_path.size() == 2;
+        return elements() == 2;
     }
 };
 
@@ -234,7 +454,7 @@ public:
     }
 
     bool good() const {
-        return m_path.size() == 2;
+        return elements() == 2;
     }
 };
 
@@ -259,7 +479,7 @@ public:
     }
 
     bool good() const {
-        return m_path.size() == 2;
+        return elements() == 2;
     }
 };
 
@@ -267,12 +487,12 @@ class HierarchyUpKey : public Key<HierarchyUpSeparator> {
 public:
     HierarchyUpKey(std::string key)
     : Key(key) {
-        m_path.push_back("up");
+        push_back("up");
     }
 
     HierarchyUpKey(std::initializer_list<std::string> tokens)
     : Key(tokens) {
-        m_path.push_back("up");
+        push_back("up");
     }
 
     IndexKey local_part() {
@@ -284,7 +504,7 @@ public:
     }
 
     bool good() const {
-        return m_path.size() == 2;
+        return elements() == 2;
     }
 };
 
@@ -0,0 +1,634 @@
+#ifndef LIBINV_KEY_CODEC_HH
+#define LIBINV_KEY_CODEC_HH
+#include <kcpolydb.h>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include "key.hh"
+#include "database.hh"
+
+/* google coding style */
+
+namespace inventory {
+
+// Binary form of the separator-joined record keys:
+//
+//   [type tag][id][kind][suffix length][suffix]
+//
+// The type tag is a byte mapped to the type name by a table stored in the
+// database. The id is a raw 16-byte UUID behind 0xff, or a string behind
+// its length; length 0 stands for the type-only key of Global. An index
+// record ends after the id, and prefixes used for scans ("Item:x.") end
+// after the kind byte, so the byte ordering of records keeps every prefix
+// scan of the mixins working. Link and hierarchy-down suffixes are the
+// binary form of the remote IndexKey with no length in front, so the links
+// of an object sort by remote type tag and "Item:x*Picture:" encodes to a
+// prefix of all its Picture links.
+//
+// Keys that can't be represented are stored as a RAW tag followed by the
+// key string.
+class KeyCodec {
+public:
+    enum Kind : uint8_t {
+        ATTRIBUTE = 1,
+        LINK,
+        MODE,
+        HIERARCHY_UP,
+        HIERARCHY_DOWN
+    };
+
+    static constexpr uint8_t META_TAG = 0;
+    static constexpr uint8_t RAW_TAG = 1;
+    static constexpr uint8_t FIRST_TAG = 2;
+    static constexpr uint8_t UUID_ID = 0xff;
+    static constexpr size_t MAX_ID = 0xfe;
+
+    // the type table record
+    static const std::string &meta_key() {
+        static const std::string key(1, META_TAG);
+        return key;
+    }
+
+    // Keys of types without a tag are encoded RAW unless allocate is set,
+    // which can never match a stored record. allocated is set when a new
+    // tag was assigned and the type table has to be stored.
+    std::string encode(const char *key, size_t size, bool allocate,
+                                       bool *allocated = nullptr) {
+        std::string out;
+        out.reserve(size / 2 + 8);
+
+        size_t owner = util::owner_length(key, size);
+        if (!encode_index(key, owner, &out, allocate, allocated))
+            return raw(key, size);
+        if (owner == size)
+            return out;
+
+        uint8_t kind = kind_of(key[owner]);
+        const char *suffix = key + owner + 1;
+        size_t suffix_size = size - owner - 1;
+        out.push_back(kind);
+        if (!suffix_size)
+            return out;
+
+        if (kind == LINK || kind == HIERARCHY_DOWN) {
+            if (!encode_remote(suffix, suffix_size, &out, allocate,
+                                                          allocated)) {
+                out.append(raw(suffix, suffix_size));
+            }
+        } else {
+            put_length(&out, suffix_size);
+            out.append(suffix, suffix_size);
+        }
+        return out;
+    }
+
+    std::string encode(const std::string &key, bool allocate,
+                       bool *allocated = nullptr) {
+        return encode(key.data(), key.size(), allocate, allocated);
+    }
+
+    void decode(const char *key, size_t size, std::string *out) const {
+        out->clear();
+        if (!size)
+            throw std::runtime_error("Bad binary key");
+
+        const uint8_t *p = reinterpret_cast<const uint8_t *>(key);
+        if (p[0] == META_TAG)
+            return;
+        if (p[0] == RAW_TAG) {
+            out->assign(key + 1, size - 1);
+            return;
+        }
+
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        size_t pos = decode_index(p, size, out);
+        if (pos == size)
+            return;
+
+        uint8_t kind = p[pos++];
+        out->push_back(separator_of(kind));
+        if (pos == size)
+            return;
+
+        if (kind == LINK || kind == HIERARCHY_DOWN) {
+            if (p[pos] == RAW_TAG)
+                out->append(key + pos + 1, size - pos - 1);
+            else if (decode_index(p + pos, size - pos, out) != size - pos)
+                throw std::runtime_error("Bad binary key");
+            return;
+        }
+
+        size_t length = get_length(p, size, &pos);
+        if (pos + length != size)
+            throw std::runtime_error("Bad binary key");
+        out->append(key + pos, length);
+    }
+
+    std::string decode(const std::string &key) const {
+        std::string out;
+        decode(key.data(), key.size(), &out);
+        return out;
+    }
+
+    // serialized type table, names in tag order
+    std::string types() const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        std::string out;
+        for (const std::string &type : m_types) {
+            put_length(&out, type.size());
+            out.append(type);
+        }
+        return out;
+    }
+
+    void load(const std::string &types) {
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        m_types.clear();
+        m_tags.clear();
+
+        const uint8_t *p = reinterpret_cast<const uint8_t *>(types.data());
+        size_t pos = 0;
+        while (pos < types.size()) {
+            size_t length = get_length(p, types.size(), &pos);
+            if (pos + length > types.size())
+                throw std::runtime_error("Bad key type table");
+            std::string type(types, pos, length);
+            m_tags[type] = FIRST_TAG + m_types.size();
+            m_types.push_back(type);
+            pos += length;
+        }
+    }
+
+    void reset() {
+        load(std::string());
+    }
+
+private:
+    static std::string raw(const char *key, size_t size) {
+        std::string out(1, RAW_TAG);
+        out.append(key, size);
+        return out;
+    }
+
+    static uint8_t kind_of(char separator) {
+        switch (separator) {
+        case '.':
+            return ATTRIBUTE;
+        case '*':
+            return LINK;
+        case '%':
+            return MODE;
+        case '<':
+            return HIERARCHY_UP;
+        default:
+            return HIERARCHY_DOWN;
+        }
+    }
+
+    static char separator_of(uint8_t kind) {
+        switch (kind) {
+        case ATTRIBUTE:
+            return '.';
+        case LINK:
+            return '*';
+        case MODE:
+            return '%';
+        case HIERARCHY_UP:
+            return '<';
+        case HIERARCHY_DOWN:
+            return '>';
+        default:
+            throw std::runtime_error("Bad binary key");
+        }
+    }
+
+    // LEB128
+    static void put_length(std::string *out, size_t length) {
+        while (length >= 0x80) {
+            out->push_back(static_cast<char>(length | 0x80));
+            length >>= 7;
+        }
+        out->push_back(static_cast<char>(length));
+    }
+
+    static size_t get_length(const uint8_t *p, size_t size, size_t *pos) {
+        size_t length = 0;
+        for (int shift = 0; *pos < size && shift < 64; shift += 7) {
+            uint8_t byte = p[(*pos)++];
+            length |= static_cast<size_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return length;
+        }
+        throw std::runtime_error("Bad binary key");
+    }
+
+    static int hex_value(char c) {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        return -1;
+    }
+
+    // only the lowercase form written by uuid_unparse() round-trips
+    static bool parse_uuid(const char *id, size_t size, uint8_t *uuid) {
+        if (size != 36)
+            return false;
+        for (size_t i = 0, byte = 0; i < size; byte++) {
+            if (i == 8 || i == 13 || i == 18 || i == 23) {
+                if (id[i++] != '-')
+                    return false;
+            }
+            int high = hex_value(id[i++]);
+            int low = hex_value(id[i++]);
+            if (high < 0 || low < 0)
+                return false;
+            uuid[byte] = high << 4 | low;
+        }
+        return true;
+    }
+
+    static void unparse_uuid(const uint8_t *uuid, std::string *out) {
+        static const char digits[] = "0123456789abcdef";
+        for (size_t byte = 0; byte < 16; byte++) {
+            if (byte == 4 || byte == 6 || byte == 8 || byte == 10)
+                out->push_back('-');
+            out->push_back(digits[uuid[byte] >> 4]);
+            out->push_back(digits[uuid[byte] & 0xf]);
+        }
+    }
+
+    bool tag(const char *type, size_t size, bool allocate, bool *allocated,
+                                                             uint8_t *tag) {
+        std::string name(type, size);
+        {
+            std::shared_lock<std::shared_mutex> lock(m_mutex);
+            auto it = m_tags.find(name);
+            if (it != m_tags.end()) {
+                *tag = it->second;
+                return true;
+            }
+        }
+        if (!allocate)
+            return false;
+
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        auto it = m_tags.find(name);
+        if (it != m_tags.end()) {
+            *tag = it->second;
+            return true;
+        }
+        if (FIRST_TAG + m_types.size() > 0xff)
+            return false;
+
+        *tag = FIRST_TAG + m_types.size();
+        m_tags[name] = *tag;
+        m_types.push_back(name);
+        if (allocated)
+            *allocated = true;
+        return true;
+    }
+
+    // "Type" or "Type:id"
+    bool encode_index(const char *key, size_t size, std::string *out,
+                                      bool allocate, bool *allocated) {
+        const char *colon = static_cast<const char *>(
+                                     std::memchr(key, ':', size));
+        size_t type_size = colon ? colon - key : size;
+        const char *id = colon ? colon + 1 : nullptr;
+        size_t id_size = colon ? size - type_size - 1 : 0;
+
+        if (!type_size || (colon && !id_size) || id_size > MAX_ID)
+            return false;
+
+        uint8_t type_tag;
+        if (!tag(key, type_size, allocate, allocated, &type_tag))
+            return false;
+        out->push_back(type_tag);
+
+        uint8_t uuid[16];
+        if (parse_uuid(id, id_size, uuid)) {
+            out->push_back(UUID_ID);
+            out->append(reinterpret_cast<char *>(uuid), sizeof(uuid));
+        } else {
+            out->push_back(static_cast<char>(id_size));
+            out->append(id ? id : "", id_size);
+        }
+        return true;
+    }
+
+    // Remote IndexKey of a link or hierarchy-down key. A bare "Type:" is
+    // only looked up, as the scan prefix of the remotes of a type, and
+    // encodes to the type tag alone.
+    bool encode_remote(const char *key, size_t size, std::string *out,
+                                     bool allocate, bool *allocated) {
+        if (util::owner_length(key, size) != size)
+            return false;
+        if (!allocate && size > 1 && key[size - 1] == ':' &&
+                               !std::memchr(key, ':', size - 1)) {
+            uint8_t type_tag;
+            if (!tag(key, size - 1, false, nullptr, &type_tag))
+                return false;
+            out->push_back(type_tag);
+            return true;
+        }
+        return encode_index(key, size, out, allocate, allocated);
+    }
+
+    // returns the number of bytes consumed
+    size_t decode_index(const uint8_t *p, size_t size,
+                                  std::string *out) const {
+        if (size < 2 || p[0] < FIRST_TAG ||
+                size_t(p[0] - FIRST_TAG) >= m_types.size()) {
+            throw std::runtime_error("Bad binary key");
+        }
+        out->append(m_types[p[0] - FIRST_TAG]);
+
+        if (p[1] == UUID_ID) {
+            if (size < 18)
+                throw std::runtime_error("Bad binary key");
+            out->push_back(':');
+            unparse_uuid(p + 2, out);
+            return 18;
+        }
+
+        size_t id_size = p[1];
+        if (!id_size)
+            return 2;
+        if (size < 2 + id_size)
+            throw std::runtime_error("Bad binary key");
+        out->push_back(':');
+        out->append(reinterpret_cast<const char *>(p + 2), id_size);
+        return 2 + id_size;
+    }
+
+    mutable std::shared_mutex m_mutex;
+    std::unordered_map<std::string, uint8_t> m_tags;
+    std::vector<std::string> m_types;
+};
+
+// A Kyoto Cabinet database storing keys in KeyCodec form. The mixins keep
+// using string keys: every record access of Kyoto Cabinet goes through
+// accept(), which is overridden to encode the key and to hand decoded keys
+// to visitors, and cursors do the same.
+template<class kdb>
+class BinaryKeyDB : public kdb {
+public:
+    typedef kyotocabinet::DB::Visitor Visitor;
+
+    class Cursor : public kdb::Cursor {
+    public:
+        explicit Cursor(BinaryKeyDB *db)
+        : kdb::Cursor(db), m_db(db) {}
+
+        bool accept(Visitor *visitor, bool writable = true, bool step = false) {
+            DecodingVisitor decoding(m_db->m_codec, visitor);
+            return kdb::Cursor::accept(&decoding, writable, step);
+        }
+
+        // the type table sorts first and is skipped
+        bool jump() {
+            const char first = KeyCodec::RAW_TAG;
+            return kdb::Cursor::jump(&first, 1);
+        }
+
+        bool jump(const char *kbuf, size_t ksiz) {
+            std::string key = m_db->m_codec.encode(kbuf, ksiz, false);
+            return kdb::Cursor::jump(key.data(), key.size());
+        }
+
+        bool jump(const std::string &key) {
+            return jump(key.data(), key.size());
+        }
+
+        bool jump_back() {
+            return kdb::Cursor::jump_back();
+        }
+
+        bool jump_back(const char *kbuf, size_t ksiz) {
+            std::string key = m_db->m_codec.encode(kbuf, ksiz, false);
+            return kdb::Cursor::jump_back(key.data(), key.size());
+        }
+
+        bool jump_back(const std::string &key) {
+            return jump_back(key.data(), key.size());
+        }
+
+    private:
+        BinaryKeyDB *m_db;
+    };
+
+    bool open(const std::string &path,
+              uint32_t mode = kdb::OWRITER | kdb::OCREATE) {
+        if (!kdb::open(path, mode))
+            return false;
+        load_types();
+        return true;
+    }
+
+    bool clear() {
+        if (!kdb::clear())
+            return false;
+        m_codec.reset();
+        return true;
+    }
+
+    // tags assigned by an aborted transaction are forgotten
+    bool end_transaction(bool commit = true) {
+        bool done = kdb::end_transaction(commit);
+        if (!commit)
+            load_types();
+        return done;
+    }
+
+    bool accept(const char *kbuf, size_t ksiz, Visitor *visitor,
+                                            bool writable = true) {
+        bool allocated = false;
+        std::string key = m_codec.encode(kbuf, ksiz, writable, &allocated);
+        if (allocated && !store_types())
+            return false;
+
+        DecodingVisitor decoding(m_codec, visitor, kbuf, ksiz);
+        return kdb::accept(key.data(), key.size(), &decoding, writable);
+    }
+
+    bool accept_bulk(const std::vector<std::string> &keys, Visitor *visitor,
+                                                     bool writable = true) {
+        bool allocated = false;
+        std::vector<std::string> encoded;
+        encoded.reserve(keys.size());
+        for (const std::string &key : keys)
+            encoded.push_back(m_codec.encode(key, writable, &allocated));
+        if (allocated && !store_types())
+            return false;
+
+        DecodingVisitor decoding(m_codec, visitor);
+        return kdb::accept_bulk(encoded, &decoding, writable);
+    }
+
+    bool iterate(Visitor *visitor, bool writable = true,
+                 typename kdb::ProgressChecker *checker = nullptr) {
+        DecodingVisitor decoding(m_codec, visitor);
+        return kdb::iterate(&decoding, writable, checker);
+    }
+
+    Cursor *cursor() {
+        return new Cursor(this);
+    }
+
+    const KeyCodec &codec() const {
+        return m_codec;
+    }
+
+private:
+    // Passes decoded keys on; the type table record isn't visited.
+    class DecodingVisitor : public Visitor {
+    public:
+        DecodingVisitor(const KeyCodec &codec, Visitor *visitor,
+                        const char *kbuf = nullptr, size_t ksiz = 0)
+        : m_codec(codec), m_visitor(visitor), m_kbuf(kbuf), m_ksiz(ksiz),
+          m_fixed(kbuf) {}
+
+        const char *visit_full(const char *kbuf, size_t ksiz,
+                   const char *vbuf, size_t vsiz, size_t *sp) {
+            if (ksiz == 1 && kbuf[0] == KeyCodec::META_TAG)
+                return NOP;
+            decode(kbuf, ksiz);
+            return m_visitor->visit_full(m_kbuf, m_ksiz, vbuf, vsiz, sp);
+        }
+
+        const char *visit_empty(const char *kbuf, size_t ksiz, size_t *sp) {
+            decode(kbuf, ksiz);
+            return m_visitor->visit_empty(m_kbuf, m_ksiz, sp);
+        }
+
+        void visit_before() {
+            m_visitor->visit_before();
+        }
+
+        void visit_after() {
+            m_visitor->visit_after();
+        }
+
+    private:
+        void decode(const char *kbuf, size_t ksiz) {
+            if (m_fixed)
+                return;
+            m_codec.decode(kbuf, ksiz, &m_key);
+            m_kbuf = m_key.data();
+            m_ksiz = m_key.size();
+        }
+
+        const KeyCodec &m_codec;
+        Visitor *m_visitor;
+        const char *m_kbuf;
+        size_t m_ksiz;
+        bool m_fixed;
+        std::string m_key;
+    };
+
+    // reads and writes of the table bypass the key translation
+    class MetaVisitor : public Visitor {
+    public:
+        MetaVisitor(std::string *value, bool write)
+        : m_value(value), m_write(write) {}
+
+        const char *visit_full(const char *kbuf, size_t ksiz,
+                   const char *vbuf, size_t vsiz, size_t *sp) {
+            if (!m_write) {
+                m_value->assign(vbuf, vsiz);
+                return NOP;
+            }
+            return visit_empty(kbuf, ksiz, sp);
+        }
+
+        const char *visit_empty(const char *kbuf, size_t ksiz, size_t *sp) {
+            if (!m_write)
+                return NOP;
+            *sp = m_value->size();
+            return m_value->data();
+        }
+
+    private:
+        std::string *m_value;
+        bool m_write;
+    };
+
+    void load_types() {
+        std::string types;
+        MetaVisitor visitor(&types, false);
+        const std::string &key = KeyCodec::meta_key();
+        kdb::accept(key.data(), key.size(), &visitor, false);
+        m_codec.load(types);
+    }
+
+    bool store_types() {
+        std::string types = m_codec.types();
+        MetaVisitor visitor(&types, true);
+        const std::string &key = KeyCodec::meta_key();
+        return kdb::accept(key.data(), key.size(), &visitor, true);
+    }
+
+    KeyCodec m_codec;
+};
+
+template<class kdb>
+class Backend<BinaryKeyDB<kdb>> {
+public:
+    static constexpr bool ordered = Backend<kdb>::ordered;
+    static constexpr bool persistent = Backend<kdb>::persistent;
+
+    static void tune(BinaryKeyDB<kdb> &db, const DatabaseOptions &options) {
+        Backend<kdb>::tune(db, options);
+    }
+};
+
+// Copies every record of a string-keyed database into a binary-keyed one,
+// committing every batch records. Returns the number of records copied.
+template<class kdb>
+int64_t migrate_keys(kyotocabinet::BasicDB &from, BinaryKeyDB<kdb> &to,
+                                                  size_t batch = 10000) {
+    std::unique_ptr<kyotocabinet::DB::Cursor> cur(from.cursor());
+    if (!cur->jump())
+        return 0;
+
+    int64_t count = 0;
+    std::string key, value;
+    bool open = false;
+    while (cur->get(&key, &value, true)) {
+        if (!open && !(open = to.begin_transaction())) {
+            throw std::runtime_error(std::string("Couldn't begin "
+                    "transaction: ") + to.error().message());
+        }
+        if (!to.set(key, value)) {
+            std::string message = to.error().message();
+            to.end_transaction(false);
+            throw std::runtime_error("Couldn't write " + key + " ("
+                                                  + message + ")");
+        }
+        if (++count % batch == 0) {
+            open = false;
+            if (!to.end_transaction(true)) {
+                throw std::runtime_error(std::string("Couldn't commit "
+                        "transaction: ") + to.error().message());
+            }
+        }
+    }
+
+    if (open && !to.end_transaction(true)) {
+        throw std::runtime_error(std::string("Couldn't commit "
+                "transaction: ") + to.error().message());
+    }
+    return count;
+}
+
+typedef Database<BinaryKeyDB<kyotocabinet::TreeDB>> CompactTreeDatabase;
+
+}
+
+#endif
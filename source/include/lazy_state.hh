@@ -0,0 +1,39 @@
+#ifndef LIBINV_LAZY_STATE_HH
+#define LIBINV_LAZY_STATE_HH
+
+/* google coding style */
+
+namespace inventory {
+
+// Database a mixin was bound to by a lazy get, until the mixin's state is
+// first accessed and loaded. Const accessors resolve it too, so the
+// pointer is mutable.
+template<class Database>
+class LazyState {
+public:
+    void defer(Database &db) {
+        m_db = &db;
+    }
+
+    void cancel() const {
+        m_db = nullptr;
+    }
+
+    bool pending() const {
+        return m_db;
+    }
+
+    // the bound database; the state counts as loaded afterwards
+    Database &take() const {
+        Database *db = m_db;
+        m_db = nullptr;
+        return *db;
+    }
+
+private:
+    mutable Database *m_db = nullptr;
+};
+
+}
+
+#endif
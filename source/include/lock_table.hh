@@ -0,0 +1,56 @@
+#ifndef LIBINV_LOCK_TABLE_HH
+#define LIBINV_LOCK_TABLE_HH
+#include <string_view>
+#include <functional>
+#include <memory>
+#include <shared_mutex>
+#include "key.hh"
+
+/* google coding style */
+
+namespace inventory {
+
+// Fixed set of rwlocks, each guarding the records of the objects whose
+// IndexKey hashes to it. Any record key maps to the stripe of its owner,
+// so writers of different objects rarely contend. Locks on several
+// stripes have to be taken in stripe address order (WriteBatch does so).
+class LockTable {
+public:
+    static constexpr size_t kDefaultStripes = 1024;
+
+    LockTable(size_t stripes = kDefaultStripes)
+    : m_size(stripes ? stripes : 1),
+      m_stripes(new Stripe[m_size]) {}
+
+    std::shared_mutex &at(std::string_view key) {
+        std::string_view owner(key.data(), util::owner_length(key.data(),
+                                                              key.size()));
+        return m_stripes[std::hash<std::string_view>()(owner) % m_size]
+                                                                  .mutex;
+    }
+
+    size_t size() const {
+        return m_size;
+    }
+
+private:
+    struct alignas(64) Stripe {
+        std::shared_mutex mutex;
+    };
+
+    const size_t m_size;
+    std::unique_ptr<Stripe[]> m_stripes;
+};
+
+// guards the records of all datamodel objects
+extern LockTable g_object_locks;
+
+// Held by hierarchical commits from reading ancestor paths until the paths
+// derived from them are written: exclusively by commits that rewrite a
+// subtree (moving an object, or adding or removing a child that has
+// children of its own), shared by the others. Taken before any stripe.
+extern std::shared_mutex g_hierarchy_lock;
+
+}
+
+#endif
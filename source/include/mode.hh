@@ -36,6 +36,17 @@ namespace inventory {
             m_mode |= (ctoi(c[2]) & 7) << 6;
         }
 
+        // the 9 permission bits, USER in the lowest three
+        static Mode from_bits(int bits) {
+            Mode mode;
+            mode.m_mode = bits & 0777;
+            return mode;
+        }
+
+        int bits() const {
+            return m_mode;
+        }
+
         std::string string() const {
             char mstr[4];
             mstr[0] = '0' + (m_mode & 7);
@@ -5,6 +5,8 @@
 #include <mutex>
 #include <shared_mutex>
 #include <functional>
+#include <vector>
+#include <string_view>
 #include "index.hh"
 #include "database.hh"
 #include "index.hh"
@@ -15,6 +17,9 @@
 #include "factory.hh"
 #include "object_ex.hh"
 #include "mode.hh"
+#include "object_header.hh"
+#include "lazy_state.hh"
+#include "graph.hh"
 
 namespace inventory {
 
@@ -25,7 +30,16 @@ class NullMixin : public RPC::MethodRoster<Database, NullMixin<Database,
 
 public:
     void get(Database &db) {}
+    void get_lazy(Database &db) {}
     void commit(Database &db) {}
+
+    void load_begin() {}
+
+    bool load(char separator, std::string_view path, std::string_view value) {
+        return false;
+    }
+
+    void commit(Database &db, WriteBatch<Database> &batch) {}
     void clear() {}
 
     std::unique_ptr<JSONRPC::SingleRequest> build_update_request(
@@ -63,9 +77,9 @@ public:
 
     void on_commit() {}
     void on_get() {}
+    void reset() {}
 };
 
-extern std::shared_mutex g_object_rwlock;
 template<class Database, template<class, class> class IndexType, class Derived,
                                         template<class, class> class ...Mixins>
 class Object : public IndexType<Database, Derived>,
@@ -86,16 +100,32 @@ class Object : public IndexType<Database, Derived>,
         template<class, class> class ...Mixins_>
     class Foreach {
     public:
-        static void get(self &object, Database &db) {
-            object.T_<Database, Derived>::get(db);
+        static void get_lazy(self &object, Database &db) {
+            object.T_<Database, Derived>::get_lazy(db);
             if (sizeof...(Mixins_))
-                Foreach<Mixins_...>::get(object, db);
+                Foreach<Mixins_...>::get_lazy(object, db);
         }
 
-        static void commit(self &object, Database &db) {
-            object.T_<Database, Derived>::commit(db);
+        static void load_begin(self &object) {
+            object.T_<Database, Derived>::load_begin();
             if (sizeof...(Mixins_))
-                Foreach<Mixins_...>::commit(object, db);
+                Foreach<Mixins_...>::load_begin(object);
+        }
+
+        static bool load(self &object, char separator, std::string_view path,
+                                                    std::string_view value) {
+            if (object.T_<Database, Derived>::load(separator, path, value))
+                return true;
+            if (sizeof...(Mixins_))
+                return Foreach<Mixins_...>::load(object, separator, path, value);
+            return false;
+        }
+
+        static void commit(self &object, Database &db,
+                           WriteBatch<Database> &batch) {
+            object.T_<Database, Derived>::commit(db, batch);
+            if (sizeof...(Mixins_))
+                Foreach<Mixins_...>::commit(object, db, batch);
         }
 
         static void rpc_method_list(std::vector<std::string> &ret) {
@@ -104,19 +134,11 @@ class Object : public IndexType<Database, Derived>,
                 Foreach<Mixins_...>::rpc_method_list(ret);
         }
 
-        static rapidjson::Value rpc_call(self &object, Database &db,
-                                        const RPC::SingleCall &call,
-                        rapidjson::Document::AllocatorType &alloc) {
-            try {
-                return object.RPC::MethodRoster<Database, T_<Database,
-                                 Derived>>::rpc_call(db, call, alloc);
-            } catch (RPC::exceptions::NoSuchMethod &e) {}
-
-            if (sizeof...(Mixins_)) {
-                return Foreach<Mixins_...>::rpc_call(object, db, call, alloc);
-            } else {
-                throw RPC::exceptions::NoSuchMethod(call.jsonrpc()->method());
-            }
+        static void rpc_method_table(RPC::MethodTable<Database, Derived>
+                                                               &table) {
+            table.add(T_<Database, Derived>::methods());
+            if (sizeof...(Mixins_))
+                Foreach<Mixins_...>::rpc_method_table(table);
         }
 
         static void repr(const self &object, rapidjson::Value &obj_repr,
@@ -162,11 +184,17 @@ class Object : public IndexType<Database, Derived>,
                 Foreach<Mixins_...>::clear(object);
         }
 
+        static void reset(self &object) {
+            object.T_<Database, Derived>::reset();
+            if (sizeof...(Mixins_))
+                Foreach<Mixins_...>::reset(object);
+        }
+
         static bool modified(const self &object) {
             if (object.T_<Database, Derived>::modified())
                 return true;
             if (sizeof...(Mixins_))
-                Foreach<Mixins_...>::modified(object);
+                return Foreach<Mixins_...>::modified(object);
             return false;
         }
 
@@ -243,10 +271,66 @@ public:
         get(db);
     }
 
+    // All records of an object sort under its IndexKey, so one scan over
+    // that prefix loads everything. Rows are handed to the mixin owning
+    // the separator that follows the IndexKey. The scan ends past the
+    // separators, and the rows of other objects whose id starts with ours
+    // that still sort in between are skipped. That relies on ids never
+    // holding a separator, which assigning an id checks. With an object cache the
+    // rows are replayed from there.
     void get(Database &db) {
-        std::shared_lock<std::shared_mutex> lock(g_object_rwlock);
-        get_modes(db);
-        Foreach<Mixins...>::get(*this, db);
+        Derived &derived = static_cast<Derived &>(*this);
+        const std::string local = derived.path().string();
+        auto lock = db.read_lock(g_object_locks.at(local));
+
+        m_lazy_modes.cancel();
+        m_legacy_modes = false;
+        Foreach<Mixins...>::load_begin(*this);
+        ObjectCache *cache = db.cache();
+        ObjectCache::Rows rows = cache ? cache->find(local) : nullptr;
+        if (rows) {
+            for (const auto &row : *rows)
+                load(local, row.first, row.second);
+        } else if (cache) {
+            uint64_t epoch = cache->epoch(local);
+            auto fresh = std::make_shared<ObjectCache::RowVector>();
+            for (const auto &record : db.object_scan(local)) {
+                if (load(local, record.first, record.second))
+                    fresh->emplace_back(record.first, record.second);
+            }
+            cache->insert(local, epoch, std::move(fresh));
+        } else {
+            for (const auto &record : db.object_scan(local))
+                load(local, record.first, record.second);
+        }
+        Foreach<Mixins...>::on_get(*this);
+    }
+
+    // Binds the modes and every mixin to db without reading anything; each
+    // loads its own records on first access. Parts loaded at different
+    // times may reflect different commits.
+    void get_lazy(Database &db, std::string id) {
+        this->IndexType<Database, Derived>::get(db, id);
+        get_lazy(db);
+    }
+
+    void get_lazy(Database &db) {
+        m_lazy_modes.defer(db);
+        Foreach<Mixins...>::get_lazy(*this, db);
+    }
+
+    // Lazy get with the listed mixins loaded right away, for known access
+    // patterns: prefetch<Container, Association>(db)
+    template<template<class, class> class ...Prefetched>
+    void prefetch(Database &db) {
+        get_lazy(db);
+        (this->Prefetched<Database, Derived>::get(db), ...);
+    }
+
+    template<template<class, class> class ...Prefetched>
+    void prefetch(Database &db, std::string id) {
+        this->IndexType<Database, Derived>::get(db, id);
+        prefetch<Prefetched...>(db);
     }
 
     void clear() {
@@ -255,10 +339,16 @@ public:
     }
 
     void remove(Database &db) {
-        std::unique_lock<std::shared_mutex> lock(g_object_rwlock);
+        load_modes(db);
+        WriteBatch<Database> batch(db);
+        batch.lock(g_object_locks);
+        remove_legacy_modes(batch);
         clear();
-        Foreach<Mixins...>::commit(*this, db);
-        IndexType<Database, Derived>::remove(db);
+        Foreach<Mixins...>::commit(*this, db, batch);
+        IndexType<Database, Derived>::remove(db, batch);
+        batch.commit();
+        Foreach<Mixins...>::on_commit(*this);
+        on_commit();
     }
 
     void get(std::shared_ptr<RPC::ClientSession> session, std::string id) {
@@ -286,17 +376,22 @@ public:
         return get_async(session, self::id());
     }
 
+    // All records of the object are written in one transaction, under the
+    // stripes of every object the batch touches.
     void commit(Database &db) {
-        std::shared_lock<std::shared_mutex> lock(g_object_rwlock);
-        this->IndexType<Database, Derived>::commit(db);
-        commit_modes(db);
-        Foreach<Mixins...>::commit(*this, db);
+        WriteBatch<Database> batch(db);
+        batch.lock(g_object_locks);
+        commit_header(db, batch);
+        Foreach<Mixins...>::commit(*this, db, batch);
+        batch.commit();
+        Foreach<Mixins...>::on_commit(*this);
         on_commit();
     }
 
     void on_commit() {
         m_remove_modes.clear();
         m_add_modes.clear();       
+        m_legacy_modes = false;
     }
 
     void commit(std::shared_ptr<RPC::ClientSession> session,
@@ -352,14 +447,21 @@ public:
 
     rapidjson::Value rpc_call(Database &db, const RPC::SingleCall &call,
                             rapidjson::Document::AllocatorType &alloc) {
-        try {
-            // for RPC implementation in Derived classes
-            Derived &derived = static_cast<Derived &>(*this); 
-            return derived.RPC::template MethodRoster<Database, Derived>::rpc_call(db,
-                                                                         call, alloc);
-        } catch (RPC::exceptions::NoSuchMethod &e) {}
+        Derived &derived = static_cast<Derived &>(*this); 
+        return rpc_method_table().call(derived, db, call, alloc);
+    }
 
-        return Foreach<Mixins...>::rpc_call(*this, db, call, alloc);
+    // Methods of Derived first, for RPC implementation in Derived classes,
+    // then those of the mixins in order.
+    static const RPC::MethodTable<Database, Derived> &rpc_method_table() {
+        static const RPC::MethodTable<Database, Derived> table = [] {
+            RPC::MethodTable<Database, Derived> table;
+            table.add(Derived::methods());
+            Foreach<Mixins...>::rpc_method_table(table);
+            table.build();
+            return table;
+        }();
+        return table;
     }
 
     rapidjson::Value rpc_create(Database &db, const RPC::SingleCall &call,
@@ -393,6 +495,11 @@ public:
         modes_from_repr(jset);
         remove_modes(jremove);
 
+        WriteBatch<Database> batch(db);
+        batch.lock(g_object_locks);
+        commit_header(db, batch);
+        batch.commit();
+        on_commit();
         return rapidjson::Value("OK");
     }
 
@@ -425,6 +532,83 @@ public:
         return rapidjson::Value("OK");
     }
 
+    // Breadth-first expansion over links and children. params: depth
+    // (default 1, at most 8), types and edges ("link", "down") filters,
+    // limit on the number of nodes (default 1000, at most 10000).
+    rapidjson::Value rpc_graph_traverse(Database &db, const RPC::SingleCall
+                        &call, rapidjson::Document::AllocatorType &alloc) {
+        using namespace rapidjson;
+        Derived &d = static_cast<Derived &>(*this); 
+        rpc_get_index(call);
+        if (!exists(db))
+            throw exceptions::NoSuchObject(d.type(), d.id());
+
+        const RPC::ObjectCallParams params(call);
+        GraphTraversal traversal;
+        if (params.has_member("depth")) {
+            const Value &jdepth = params["depth"];
+            if (!jdepth.IsUint() || !jdepth.GetUint())
+                throw RPC::exceptions::InvalidParameters("bad \"depth\"");
+            traversal.max_depth = std::min(jdepth.GetUint(), 8u);
+        }
+        if (params.has_member("limit")) {
+            const Value &jlimit = params["limit"];
+            if (!jlimit.IsUint() || !jlimit.GetUint())
+                throw RPC::exceptions::InvalidParameters("bad \"limit\"");
+            traversal.limit = std::min(jlimit.GetUint(), 10000u);
+        }
+        if (params.has_member("types")) {
+            const Value &jtypes = params["types"];
+            if (!jtypes.IsArray())
+                throw RPC::exceptions::InvalidParameters("bad \"types\"");
+            for (const Value &jtype : jtypes.GetArray()) {
+                if (!jtype.IsString())
+                    throw RPC::exceptions::InvalidParameters("bad \"types\"");
+                traversal.types.insert(jtype.GetString());
+            }
+        }
+        if (params.has_member("edges")) {
+            const Value &jedges = params["edges"];
+            if (!jedges.IsArray())
+                throw RPC::exceptions::InvalidParameters("bad \"edges\"");
+            traversal.edges = 0;
+            for (const Value &jedge : jedges.GetArray()) {
+                std::string edge = jedge.IsString() ? jedge.GetString() : "";
+                if (edge == "link")
+                    traversal.edges |= GraphTraversal::LINK;
+                else if (edge == "down")
+                    traversal.edges |= GraphTraversal::DOWN;
+                else
+                    throw RPC::exceptions::InvalidParameters("bad \"edges\"");
+            }
+        }
+
+        bool truncated;
+        std::vector<GraphTraversal::Node> nodes = traversal.run(db, d.path(),
+            [&](std::vector<IndexKey> &keys) {
+                RPC::authorize_listing(db, call, keys);
+            }, &truncated);
+
+        Value jnodes(kArrayType);
+        for (const GraphTraversal::Node &node : nodes) {
+            Value jnode(kObjectType);
+            Value jid, jvia;
+            jid.SetString(node.key.string().c_str(), alloc);
+            jvia.SetString(node.via.string().c_str(), alloc);
+            jnode.AddMember("id", jid, alloc);
+            jnode.AddMember("depth", node.depth, alloc);
+            jnode.AddMember("via", jvia, alloc);
+            jnode.AddMember("edge", StringRef(node.edge ==
+                   GraphTraversal::LINK ? "link" : "down"), alloc);
+            jnodes.PushBack(jnode, alloc);
+        }
+
+        Value jresult(kObjectType);
+        jresult.AddMember("nodes", jnodes, alloc);
+        jresult.AddMember("truncated", truncated, alloc);
+        return jresult;
+    }
+
     rapidjson::Value rpc_get(Database &db, const RPC::SingleCall &call,
                            rapidjson::Document::AllocatorType &alloc) {
         rpc_get_index(call);
@@ -491,6 +675,20 @@ public:
         return Derived::type();
     }
 
+    // Empties the object in place: containers are cleared rather than
+    // rebuilt, and the id is left unset rather than generated.
+    virtual void recycle() {
+        this->IndexType<Database, Derived>::reset_id();
+        m_modes.clear();
+        m_add_modes.clear();
+        m_remove_modes.clear();
+        m_lazy_modes.cancel();
+        m_version = 0;
+        m_header_seen = false;
+        m_legacy_modes = false;
+        Foreach<Mixins...>::reset(*this);
+    }
+
     bool modified() const {
         return Foreach<Mixins...>::modified(*this);
     }
@@ -506,6 +704,8 @@ public:
             RPC::Method<Database, Derived>("mode.update", &self::rpc_mode_update),
             RPC::Method<Database, Derived>("remove", &self::rpc_remove),
             RPC::Method<Database, Derived>("clear", &self::rpc_clear),
+            RPC::Method<Database, Derived>("graph.traverse",
+                                        &self::rpc_graph_traverse),
         });
         return ret;
     }
@@ -516,18 +716,22 @@ public:
 
     void rpc_get_index(const RPC::SingleCall &call) {
         if (!RPC::ObjectCallParams(call).id().empty()) {
-            this->IndexType<Database, Derived>::assign_id(
-                        RPC::ObjectCallParams(call).id());
+            std::string id = RPC::ObjectCallParams(call).id();
+            if (util::owner_length(id.data(), id.size()) != id.size())
+                throw RPC::exceptions::InvalidParameters("Bad id.");
+            this->IndexType<Database, Derived>::assign_id(id);
         } else {
             throw RPC::exceptions::InvalidParameters("No id supplied.");
         }
     }
 
     const ModeMap &modes() const {
+        resolve_modes();
         return m_modes;
     }
 
     void clear_modes() {
+        resolve_modes();
         m_modes.clear();
         m_add_modes.clear();
         m_remove_modes.clear();
@@ -535,23 +739,88 @@ public:
 
     bool access(std::string handle, enum Ownership owner,
                                 enum Right right) const {
+        resolve_modes();
         ModeMap::const_iterator mit = m_modes.find(handle);
         if (mit == m_modes.end())
             return false;
         return mit->second.access(owner, right);
     }
 
+    // Point lookup of a single mode without loading the object: the
+    // header, or the mode record of a legacy object.
+    Mode get_mode(Database &db, std::string handle) {
+        Derived &derived = static_cast<Derived &>(*this); 
+        Mode retv;
+
+        ObjectHeader header;
+        if (!get_header(db, &header))
+            return retv;
+        if (header.version) {
+            header.find_mode(handle, &retv);
+            return retv;
+        }
+
+        ModeKey key({derived.path(), handle});
+        auto lock = db.read_lock(g_object_locks.at(key.string()));
+        std::string modestr;
+        if (db.impl().get(key, &modestr))
+            retv.from_string(modestr.c_str());
+        return retv;
+    }
+
+    // One read of the index record; false if the object doesn't exist.
+    // Legacy objects have an empty header, version 0.
+    bool get_header(Database &db, ObjectHeader *header) {
+        Derived &derived = static_cast<Derived &>(*this); 
+        IndexKey key = derived.path();
+        if (!db.may_exist(key))
+            return false;
+
+        auto lock = db.read_lock(g_object_locks.at(key.string()));
+        std::string value;
+        if (!db.impl().get(key, &value))
+            return false;
+        if (!header->decode(value))
+            *header = ObjectHeader();
+        return true;
+    }
+
+    // version of the last commit loaded or made by this instance
+    uint64_t version() const {
+        resolve_modes();
+        return m_version;
+    }
+
+    static uint32_t mixin_bits() {
+        static const uint32_t bits = [] {
+            uint32_t ret = 0;
+            for (const std::string &type : mixin_list())
+                ret |= ObjectHeader::mixin_bit(type);
+            return ret;
+        }();
+        return bits;
+    }
+
+    bool access(Database &db, std::string handle, enum Ownership owner,
+                                                  enum Right right) {
+        return get_mode(db, handle).access(owner, right);
+    }
+
     void set_mode(std::string handle, Mode mode) {
+        resolve_modes();
         m_modes[handle] = mode;
         m_add_modes[handle] = mode;
+        m_remove_modes.erase(handle);
     }
 
     void remove_mode(std::string handle) {
+        resolve_modes();
+        // recorded even if not seen here: the stored header may hold it
         ModeMap::iterator mit = m_modes.find(handle);
-        if (mit != m_modes.end()) {
-            m_remove_modes[handle] = mit->second;
+        m_remove_modes[handle] = mit != m_modes.end() ? mit->second : Mode();
+        m_add_modes.erase(handle);
+        if (mit != m_modes.end())
             m_modes.erase(mit);
-        }
     }
 
     std::unique_ptr<JSONRPC::SingleRequest> build_get_request(std::string id,
@@ -829,64 +1098,157 @@ private:
     void foreach_mode(Database &db, ForeachModeCb cb) {
         Derived &derived = static_cast<Derived &>(*this); 
 
-        std::unique_ptr<kyotocabinet::DB::Cursor> cur(db.impl().cursor());
-        if (!cur->jump(ModeKey::prefix(derived.path())))
-            return;
-
-        std::string path, modestr;
-        while (cur->get(&path, &modestr, true)) {
-            ModeKey key(path);
-            if (key.path_part() != derived.path().string())
-                break;
+        for (const auto &record : db.scan(ModeKey::prefix(derived.path()))) {
+            ModeKeyView key(record.first);
             if (!key.good())
                 continue;
 
-            Mode mode(modestr);
-            cb(key.handle_part(), mode);
+            Mode mode{std::string(record.second)};
+            cb(std::string(key.handle_part()), mode);
         }
     }
 
+    void resolve_modes() const {
+        if (!m_lazy_modes.pending())
+            return;
+        self &object = const_cast<self &>(*this);
+        Database &db = m_lazy_modes.take();
+        auto lock = db.read_lock(g_object_locks.at(
+                 static_cast<Derived &>(object).path().string()));
+        object.get_modes(db);
+    }
+
+    // Modes and version from the header, or from the mode records of a
+    // legacy object. Local changes take precedence.
     void get_modes(Database &db) {
+        Derived &derived = static_cast<Derived &>(*this); 
+        m_header_seen = true;
+
+        std::string value;
+        if (!db.impl().get(derived.path(), &value))
+            return;
+
+        ObjectHeader header;
+        if (header.decode(value)) {
+            m_version = header.version;
+            for (const auto &pair : header.modes)
+                merge_mode(pair.first, pair.second);
+            return;
+        }
+
         foreach_mode(db,
             [this](std::string handle, Mode mode) -> void {
-                m_modes[handle] = mode;
+                m_legacy_modes = true;
+                merge_mode(handle, mode);
             }
         );
     }
 
-    void commit_modes(Database &db) {
-        for (const auto &pair : m_remove_modes)
-            remove_mode(db, pair.first);
-        for (const auto &pair : m_add_modes)
-            set_mode(db, pair.first, pair.second);
-
-        m_remove_modes.clear();
-        m_add_modes.clear();
+    void merge_mode(const std::string &handle, Mode mode) {
+        if (!m_remove_modes.count(handle))
+            m_modes.emplace(handle, mode);
     }
 
-    Mode get_mode(Database &db, std::string handle) const {
-        Derived &derived = static_cast<Derived &>(*this); 
-        Mode retv;
+    // Legacy objects keep their modes in separate records, which the
+    // first header commit folds in.
+    void load_modes(Database &db) {
+        resolve_modes();
+        if (m_header_seen)
+            return;
 
-        ModeKey key({derived.path(), handle});
-        std::string modestr;
-        if (db.impl().get(key, &modestr))
-            retv.from_string(modestr.c_str());
-        return retv;
+        Derived &derived = static_cast<Derived &>(*this); 
+        auto lock = db.read_lock(g_object_locks.at(derived.path().string()));
+        get_modes(db);
     }
 
-    void set_mode(Database &db, std::string handle, Mode mode) {
-        Derived &derived = static_cast<Derived &>(*this); 
+    // The header is rewritten from the stored one when the batch is
+    // applied, under the object's stripe: only this instance's mode
+    // changes are merged in and the version follows the stored one, so a
+    // stale instance can't undo other commits. An object without a header
+    // yet starts from the modes this instance loaded.
+    void commit_header(Database &db, WriteBatch<Database> &batch) {
+        load_modes(db);
+
+        ObjectHeader initial;
+        initial.version = m_version;
+        initial.mixins = mixin_bits();
+        initial.modes.assign(m_modes.begin(), m_modes.end());
+        this->IndexType<Database, Derived>::commit(db, batch,
+            [this, initial, add = m_add_modes, remove = m_remove_modes]
+                                     (const std::string *stored) {
+                ObjectHeader header;
+                bool decoded = false;
+                try {
+                    decoded = stored && header.decode(*stored);
+                } catch (const std::runtime_error &) {}
+
+                if (decoded) {
+                    ModeMap modes(header.modes.begin(), header.modes.end());
+                    for (const auto &pair : remove)
+                        modes.erase(pair.first);
+                    for (const auto &pair : add)
+                        modes[pair.first] = pair.second;
+                    header.modes.assign(modes.begin(), modes.end());
+                } else {
+                    header = initial;
+                }
+                header.version++;
+                header.mixins = initial.mixins;
+
+                m_version = header.version;
+                m_modes = ModeMap(header.modes.begin(), header.modes.end());
+                return header.encode();
+            });
+        remove_legacy_modes(batch);
+    }
+
+    // mode records of objects committed before the header held them
+    void remove_legacy_modes(WriteBatch<Database> &batch) {
+        if (!m_legacy_modes)
+            return;
+        for (const auto &pair : m_modes)
+            remove_mode(batch, pair.first);
+        for (const auto &pair : m_remove_modes)
+            remove_mode(batch, pair.first);
+    }
+
+    // Dispatches one record of a single-pass load, false if it doesn't
+    // belong to this object.
+    bool load(const std::string &local, std::string_view path,
+                                        std::string_view value) {
+        if (path.size() == local.size()) {
+            if (path != local)
+                return false;
+
+            ObjectHeader header;
+            m_header_seen = true;
+            if (header.decode(value)) {
+                m_version = header.version;
+                for (const auto &pair : header.modes)
+                    m_modes[pair.first] = pair.second;
+            }
+            return true;
+        }
+        if (util::owner_length(path.data(), path.size()) != local.size())
+            return false;
 
-        ModeKey key({derived.path(), handle});
-        db.impl().set(key, mode.string()); // TODO throw
+        char separator = path[local.size()];
+        if (separator == ModeSeparator::string()[0]) {
+            ModeKeyView key(path);
+            if (key.good())
+                m_modes[std::string(key.handle_part())] =
+                                     Mode(std::string(value));
+            m_legacy_modes = true;
+            return true;
+        }
+        return Foreach<Mixins...>::load(*this, separator, path, value);
     }
 
-    void remove_mode(Database &db, std::string handle) {
+    void remove_mode(WriteBatch<Database> &batch, std::string handle) {
         Derived &derived = static_cast<Derived &>(*this); 
 
         ModeKey key({derived.path(), handle});
-        db.impl().remove(key); // TODO throw
+        batch.remove(key);
     }
 
     static rapidjson::Value mode_repr(std::string handle, Mode mode,
@@ -910,6 +1272,7 @@ private:
                                                    &alloc) const {
         using namespace rapidjson;
 
+        resolve_modes();
         Value jmodes(kArrayType);
         foreach_mode(m_modes,
             [&](std::string handle, Mode mode) -> void {
@@ -967,6 +1330,10 @@ private:
     ModeMap m_modes;
     ModeMap m_add_modes;
     ModeMap m_remove_modes;
+    LazyState<Database> m_lazy_modes;
+    uint64_t m_version = 0;
+    bool m_header_seen = false;
+    bool m_legacy_modes = false;
 };
 
 
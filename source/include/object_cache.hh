@@ -0,0 +1,176 @@
+#ifndef LIBINV_OBJECT_CACHE_HH
+#define LIBINV_OBJECT_CACHE_HH
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include "key.hh"
+#include "write_batch.hh"
+
+/* google coding style */
+
+namespace inventory {
+
+// Sharded LRU cache of the records of whole objects, keyed by IndexKey.
+// Object::get() replays a cached entry instead of scanning the tree.
+//
+// Entries are the raw rows, not decoded objects: one cache serves every
+// object type of a Database, and a get() fills a caller-owned, mutable
+// object, so a decoded entry would have to be type-erased and copied out
+// again anyway. Replaying rows saves the tree descent and page reads;
+// decoding is still done by the mixins on every hit.
+//
+// Entries are dropped by the Database whenever a record owned by the
+// object is written. A loader takes the shard epoch before it scans and
+// insert() refuses the entry if a write to the shard happened meanwhile,
+// so a scan racing with a commit never caches stale records.
+class ObjectCache {
+public:
+    typedef std::vector<std::pair<std::string, std::string>> RowVector;
+    typedef std::shared_ptr<const RowVector> Rows;
+
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t entries;
+        uint64_t bytes;
+    };
+
+    ObjectCache(size_t capacity, size_t shards = 16)
+    : m_shards(shards ? shards : 1) {
+        for (Shard &shard : m_shards)
+            shard.capacity = capacity / m_shards.size();
+    }
+
+    Rows find(const std::string &key) {
+        Shard &shard = shard_of(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        auto it = shard.index.find(key);
+        if (it == shard.index.end()) {
+            m_misses++;
+            return nullptr;
+        }
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        m_hits++;
+        return it->second->rows;
+    }
+
+    uint64_t epoch(const std::string &key) {
+        Shard &shard = shard_of(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.epoch;
+    }
+
+    void insert(const std::string &key, uint64_t epoch, Rows rows) {
+        size_t size = entry_size(key, *rows);
+        Shard &shard = shard_of(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        if (shard.epoch != epoch || size > shard.capacity)
+            return;
+
+        erase(shard, key);
+        shard.lru.push_front({key, std::move(rows), size});
+        shard.index[key] = shard.lru.begin();
+        shard.bytes += size;
+
+        while (shard.bytes > shard.capacity) {
+            Entry &last = shard.lru.back();
+            shard.bytes -= last.size;
+            shard.index.erase(last.key);
+            shard.lru.pop_back();
+        }
+    }
+
+    // key is the IndexKey of an object that's being written
+    void invalidate(const std::string &key) {
+        Shard &shard = shard_of(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.epoch++;
+        erase(shard, key);
+    }
+
+    // invalidates the owner of each written record
+    void invalidate(const WriteOpMap &ops) {
+        std::string_view last;
+        for (const auto &op : ops) {
+            std::string_view owner(op.first.data(),
+                    util::owner_length(op.first.data(), op.first.size()));
+            if (owner == last)
+                continue;
+            invalidate(std::string(owner));
+            last = owner;
+        }
+    }
+
+    void clear() {
+        for (Shard &shard : m_shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.epoch++;
+            shard.lru.clear();
+            shard.index.clear();
+            shard.bytes = 0;
+        }
+    }
+
+    Stats stats() {
+        Stats stats = {m_hits, m_misses, 0, 0};
+        for (Shard &shard : m_shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            stats.entries += shard.lru.size();
+            stats.bytes += shard.bytes;
+        }
+        return stats;
+    }
+
+private:
+    struct Entry {
+        std::string key;
+        Rows rows;
+        size_t size;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::list<Entry> lru;
+        std::unordered_map<std::string, std::list<Entry>::iterator> index;
+        size_t bytes = 0;
+        size_t capacity = 0;
+        uint64_t epoch = 0;
+    };
+
+    static size_t entry_size(const std::string &key, const RowVector &rows) {
+        size_t size = sizeof(Entry) + 2 * key.size();
+        for (const auto &row : rows)
+            size += sizeof(row) + row.first.size() + row.second.size();
+        return size;
+    }
+
+    Shard &shard_of(const std::string &key) {
+        return m_shards[std::hash<std::string>()(key) % m_shards.size()];
+    }
+
+    void erase(Shard &shard, const std::string &key) {
+        auto it = shard.index.find(key);
+        if (it == shard.index.end())
+            return;
+        shard.bytes -= it->second->size;
+        shard.lru.erase(it->second);
+        shard.index.erase(it);
+    }
+
+    std::vector<Shard> m_shards;
+    std::atomic<uint64_t> m_hits{0};
+    std::atomic<uint64_t> m_misses{0};
+};
+
+}
+
+#endif
@@ -0,0 +1,155 @@
+#ifndef LIBINV_OBJECT_HEADER_HH
+#define LIBINV_OBJECT_HEADER_HH
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <stdexcept>
+#include "mode.hh"
+
+/* google coding style */
+
+namespace inventory {
+
+// Value of an object's index record:
+//
+//   [format][version][mixin bitmap][mode count]([handle][mode])...
+//
+// Numbers and lengths are varints, handles are length-prefixed and each
+// mode is the 9 permission bits in two bytes, so existence, version and
+// ACL checks take one point read. An empty value is an object committed
+// before the header existed; its modes are separate records.
+class ObjectHeader {
+public:
+    typedef std::vector<std::pair<std::string, Mode>> ModeTable;
+
+    static constexpr uint8_t FORMAT = 1;
+
+    enum MixinBit : uint32_t {
+        KV = 1,
+        ASSOCIATIVE = 2,
+        HIERARCHICAL = 4,
+        GLOBAL = 8
+    };
+
+    static uint32_t mixin_bit(const std::string &mixin_type) {
+        if (mixin_type == "kv")
+            return KV;
+        if (mixin_type == "associative")
+            return ASSOCIATIVE;
+        if (mixin_type == "hierarchical")
+            return HIERARCHICAL;
+        if (mixin_type == "global")
+            return GLOBAL;
+        return 0;
+    }
+
+    std::string encode() const {
+        std::string out(1, FORMAT);
+        put_number(&out, version);
+        put_number(&out, mixins);
+        put_number(&out, modes.size());
+        for (const auto &pair : modes) {
+            put_number(&out, pair.first.size());
+            out.append(pair.first);
+            out.push_back(static_cast<char>(pair.second.bits() & 0xff));
+            out.push_back(static_cast<char>(pair.second.bits() >> 8));
+        }
+        return out;
+    }
+
+    // false for a legacy (empty) value
+    bool decode(std::string_view value) {
+        modes.clear();
+        if (value.empty())
+            return false;
+
+        const uint8_t *p = reinterpret_cast<const uint8_t *>(value.data());
+        size_t size = value.size();
+        size_t pos = 0;
+        if (p[pos++] != FORMAT)
+            throw std::runtime_error("Bad object header");
+
+        version = get_number(p, size, &pos);
+        mixins = get_number(p, size, &pos);
+        size_t count = get_number(p, size, &pos);
+        for (size_t i = 0; i < count; i++) {
+            size_t length = get_number(p, size, &pos);
+            if (pos + length + 2 > size)
+                throw std::runtime_error("Bad object header");
+            std::string handle(value.substr(pos, length));
+            pos += length;
+            int bits = p[pos] | p[pos + 1] << 8;
+            pos += 2;
+            modes.emplace_back(std::move(handle), Mode::from_bits(bits));
+        }
+        return true;
+    }
+
+    // Calls f(handle, mode) for each entry of an encoded header without
+    // copying; false for a legacy value.
+    template<class F>
+    static bool visit_modes(std::string_view value, F f) {
+        if (value.empty())
+            return false;
+
+        const uint8_t *p = reinterpret_cast<const uint8_t *>(value.data());
+        size_t size = value.size();
+        size_t pos = 0;
+        if (p[pos++] != FORMAT)
+            throw std::runtime_error("Bad object header");
+
+        get_number(p, size, &pos);
+        get_number(p, size, &pos);
+        size_t count = get_number(p, size, &pos);
+        for (size_t i = 0; i < count; i++) {
+            size_t length = get_number(p, size, &pos);
+            if (pos + length + 2 > size)
+                throw std::runtime_error("Bad object header");
+            std::string_view handle = value.substr(pos, length);
+            pos += length;
+            f(handle, Mode::from_bits(p[pos] | p[pos + 1] << 8));
+            pos += 2;
+        }
+        return true;
+    }
+
+    bool find_mode(std::string_view handle, Mode *mode) const {
+        for (const auto &pair : modes) {
+            if (pair.first == handle) {
+                *mode = pair.second;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    uint64_t version = 0;
+    uint32_t mixins = 0;
+    ModeTable modes;
+
+private:
+    static void put_number(std::string *out, uint64_t n) {
+        while (n >= 0x80) {
+            out->push_back(static_cast<char>(n | 0x80));
+            n >>= 7;
+        }
+        out->push_back(static_cast<char>(n));
+    }
+
+    static uint64_t get_number(const uint8_t *p, size_t size, size_t *pos) {
+        uint64_t n = 0;
+        for (int shift = 0; *pos < size && shift < 64; shift += 7) {
+            uint8_t byte = p[(*pos)++];
+            n |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return n;
+        }
+        throw std::runtime_error("Bad object header");
+    }
+};
+
+}
+
+#endif
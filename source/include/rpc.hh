@@ -6,8 +6,12 @@
 #include <algorithm>
 #include <stdexcept>
 #include <future>
+#include <string>
+#include <string_view>
+#include <cstdint>
 #include <rapidjson/document.h>
 #include "datamodel.hh"
+#include "arena.hh"
 #include "jsonrpc.hh"
 #include "workqueue.hh"
 #include "factory.hh"
@@ -47,7 +51,8 @@ protected:
 class Server;
 class ServerSession : public std::enable_shared_from_this<ServerSession> {
 public:
-    // called by RPC::Request instances
+    // called by RPC::Request instances. The response may be allocated from
+    // the calling thread's RequestArena: serialize it before returning.
     virtual void reply_async(std::unique_ptr<JSONRPC::ResponseBase>
                                                      response) = 0;
     virtual void terminate();
@@ -56,6 +61,10 @@ public:
         return *mp_user;
     }
 
+    bool has_user() const {
+        return mp_user != nullptr;
+    }
+
     Server &server() const {
         return *m_server;
     }
@@ -124,7 +133,7 @@ public:
     CallBase(ServerSession *session)
     : m_session(session) {}
 
-    ServerSession *session() {
+    ServerSession *session() const {
         return m_session;
     }
 
@@ -157,7 +166,8 @@ public:
 
     // Returns an empty unique_ptr if there should be no response
     template<class Database, class Datamodel>
-    std::unique_ptr<JSONRPC::ResponseBase> complete(Database &db) const;
+    std::unique_ptr<JSONRPC::ResponseBase> complete(Database &db,
+        rapidjson::Document::AllocatorType *alloc = nullptr) const;
 
 private:
     union {
@@ -294,10 +304,21 @@ private:
     } m_params;
 };
 
+// Drops the keys of a listing the calling user may not LIST. Calls without
+// a session user aren't filtered.
+template<class Database>
+void authorize_listing(Database &db, const SingleCall &call,
+                               std::vector<IndexKey> &keys) {
+    if (!call.session() || !call.session()->has_user())
+        return;
+    g_authorizer.filter(db, call.session()->user(), keys, LIST);
+}
+
 template<class Database, class Datamodel>
-std::unique_ptr<JSONRPC::ResponseBase> BatchCall::complete(Database &db)
-                                                                 const {
-    JSONRPC::BatchResponse *bresp = new JSONRPC::BatchResponse;
+std::unique_ptr<JSONRPC::ResponseBase> BatchCall::complete(Database &db,
+                      rapidjson::Document::AllocatorType *alloc) const {
+    JSONRPC::BatchResponse *bresp = alloc ? new JSONRPC::BatchResponse(alloc)
+                                          : new JSONRPC::BatchResponse;
     std::unique_ptr<JSONRPC::ResponseBase> resp_uniqptr(bresp);
     m_req.cptr->foreach([&, this](const JSONRPC::SingleRequest &srequest){
         try {
@@ -324,7 +345,9 @@ std::unique_ptr<JSONRPC::ResponseBase> BatchCall::complete(Database &db)
 template<class Database, class Datamodel>
 std::unique_ptr<JSONRPC::ResponseBase> SingleCall::complete(Database &db,
                        rapidjson::Document::AllocatorType *alloc) const {
-    JSONRPC::SingleResponse *single_response = new JSONRPC::SingleResponse;
+    JSONRPC::SingleResponse *single_response = alloc ?
+                    new JSONRPC::SingleResponse(alloc) :
+                    new JSONRPC::SingleResponse;
     std::unique_ptr<JSONRPC::ResponseBase> response_uniqptr(single_response);
 
     if (alloc == nullptr)
@@ -365,9 +388,7 @@ rapidjson::Value SingleCall::complete_datamodel_call(
 
     //std::cout << "debug request: " << m_req.cptr->string() << std::endl;
     std::string objtype = ObjectCallParams(*this).type();
-    std::unique_ptr<DatamodelObject<Database>> obj( 
-              Datamodel::template create<Database>(
-                                         objtype));
+    auto obj = Datamodel::template acquire<Database>(objtype);
     return obj->rpc_call(db, *this, alloc);
 }
 
@@ -386,9 +407,7 @@ public:
     virtual rapidjson::Value complete(Database &db, const SingleCall &call,
                                rapidjson::Document::AllocatorType &alloc) {
         std::string objtype = ObjectCallParams(call).type();
-        std::unique_ptr<DatamodelObject<Database>> obj( 
-                  Datamodel::template create<Database>(
-                                             objtype));
+        auto obj = Datamodel::template acquire<Database>(objtype);
         return obj->rpc_call(db, call, alloc);
     } 
 };
@@ -639,21 +658,26 @@ public:
                        std::shared_ptr<ServerSession> session) 
     : m_session(session), m_request(std::move(request)) {}
 
+    // The request and response documents live in the thread's
+    // RequestArena, released when complete() returns.
     template<class Database, class Datamodel>
     void complete(Database &db) { 
+        RequestArena::Scope arena;
         std::unique_ptr<JSONRPC::ResponseBase> response;
 
         try {
-            m_request->parse(); // throws
+            m_request->parse(&arena.allocator()); // throws
             // std::cout << "debug request (server): " << m_request->string() << std::endl;
             if (m_request->is_batch()) {
-                JSONRPC::BatchRequest breq(std::move(*m_request.release()));
+                JSONRPC::BatchRequest breq(std::move(*m_request));
                 BatchCall batch(&breq, m_session.get());
-                response = batch.complete<Database, Datamodel>(db);
+                response = batch.complete<Database, Datamodel>(db,
+                                                &arena.allocator());
             } else {
-                JSONRPC::SingleRequest sreq(std::move(*m_request.release()));
+                JSONRPC::SingleRequest sreq(std::move(*m_request));
                 SingleCall single(&sreq, m_session.get());
-                response = single.complete<Database, Datamodel>(db);
+                response = single.complete<Database, Datamodel>(db,
+                                                 &arena.allocator());
             }
         } catch (const JSONRPC::exceptions::ParseError &e) {
             JSONRPC::SingleResponse *sresp = new JSONRPC::SingleResponse;
@@ -736,6 +760,113 @@ public:
     }
 };
 
+// RPC methods of an object type and all of its mixins, hashed into a
+// collision-free table once per type. A lookup costs one hash and one
+// string comparison, and a miss is reported without exceptions.
+template<class Database, class Object>
+class MethodTable {
+public:
+    typedef rapidjson::Value (*Invoker)(Object &, const void *, Database &,
+                const SingleCall &, rapidjson::Document::AllocatorType &);
+
+    struct Entry {
+        std::string name;
+        const void *method;
+        Invoker invoke;
+    };
+
+    // a name already added earlier keeps its method
+    template<class Mixin>
+    void add(const std::vector<Method<Database, Mixin>> &methods) {
+        for (const Method<Database, Mixin> &m : methods) {
+            if (!find_linear(m.name()))
+                m_entries.push_back({m.name(), &m, &invoke<Mixin>});
+        }
+    }
+
+    // picks a seed for which no two names share a slot
+    void build() {
+        size_t size = 1;
+        while (size < 2 * m_entries.size())
+            size <<= 1;
+        for (;; size <<= 1) {
+            for (uint64_t seed = 0; seed < kSeedAttempts; seed++) {
+                if (place(size, seed))
+                    return;
+            }
+        }
+    }
+
+    const Entry *find(std::string_view name) const {
+        if (m_slots.empty())
+            return nullptr;
+        int32_t slot = m_slots[hash(name, m_seed) & (m_slots.size() - 1)];
+        if (slot < 0 || m_entries[slot].name != name)
+            return nullptr;
+        return &m_entries[slot];
+    }
+
+    rapidjson::Value call(Object &object, Database &db, const SingleCall &call,
+                    rapidjson::Document::AllocatorType &alloc) const {
+        std::string name = call.jsonrpc()->namespaces().path();
+        const Entry *entry = find(name);
+        if (!entry)
+            throw RPC::exceptions::NoSuchMethod(name);
+        return entry->invoke(object, entry->method, db, call, alloc);
+    }
+
+    size_t size() const {
+        return m_entries.size();
+    }
+
+private:
+    static constexpr uint64_t kSeedAttempts = 256;
+
+    template<class Mixin>
+    static rapidjson::Value invoke(Object &object, const void *method,
+                Database &db, const SingleCall &call,
+                rapidjson::Document::AllocatorType &alloc) {
+        const Method<Database, Mixin> &m =
+                  *static_cast<const Method<Database, Mixin> *>(method);
+        return m(static_cast<Mixin &>(object), db, call, alloc);
+    }
+
+    // FNV-1a
+    static uint64_t hash(std::string_view name, uint64_t seed) {
+        uint64_t h = 0xcbf29ce484222325ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+        for (char c : name) {
+            h ^= static_cast<unsigned char>(c);
+            h *= 0x100000001b3ULL;
+        }
+        return h ^ (h >> 32);
+    }
+
+    bool place(size_t size, uint64_t seed) {
+        std::vector<int32_t> slots(size, -1);
+        for (size_t i = 0; i < m_entries.size(); i++) {
+            int32_t &slot = slots[hash(m_entries[i].name, seed) & (size - 1)];
+            if (slot >= 0)
+                return false;
+            slot = i;
+        }
+        m_slots = std::move(slots);
+        m_seed = seed;
+        return true;
+    }
+
+    const Entry *find_linear(const std::string &name) const {
+        for (const Entry &entry : m_entries) {
+            if (entry.name == name)
+                return &entry;
+        }
+        return nullptr;
+    }
+
+    std::vector<Entry> m_entries;
+    std::vector<int32_t> m_slots;
+    uint64_t m_seed = 0;
+};
+
 }
 }
 
@@ -0,0 +1,141 @@
+#ifndef LIBINV_SCAN_HH
+#define LIBINV_SCAN_HH
+#include <kcpolydb.h>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <iterator>
+#include <memory>
+
+/* google coding style */
+
+namespace inventory {
+
+// Input range over the records whose keys start with a prefix, in key
+// order. Records are read through Cursor::accept() into buffers reused for
+// every row, and the views handed out stay valid until the next increment.
+// The scan stops at the first key outside the prefix, or not before end
+// if one is given. A scan may start further into the prefix, at the first
+// key not before from.
+class PrefixScan {
+public:
+    typedef std::pair<std::string_view, std::string_view> Record;
+
+    class iterator {
+    public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef Record value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const Record *pointer;
+        typedef const Record &reference;
+
+        iterator()
+        : m_scan(nullptr) {}
+
+        explicit iterator(PrefixScan *scan)
+        : m_scan(scan) {}
+
+        reference operator*() const {
+            return m_scan->m_record;
+        }
+
+        pointer operator->() const {
+            return &m_scan->m_record;
+        }
+
+        iterator &operator++() {
+            if (!m_scan->next())
+                m_scan = nullptr;
+            return *this;
+        }
+
+        bool operator==(const iterator &i) const {
+            return m_scan == i.m_scan;
+        }
+
+        bool operator!=(const iterator &i) const {
+            return m_scan != i.m_scan;
+        }
+
+    private:
+        PrefixScan *m_scan;
+    };
+
+    PrefixScan(kyotocabinet::DB::Cursor *cur, std::string prefix,
+               std::string from = std::string(),
+               std::string end = std::string())
+    : m_cur(cur), m_reader(std::move(prefix), std::move(end)),
+      m_from(std::move(from)) {}
+
+    iterator begin() {
+        if (!m_started) {
+            m_started = true;
+            const std::string &start = m_from.size() > m_reader.prefix().size()
+                                       ? m_from : m_reader.prefix();
+            m_valid = m_cur->jump(start) && next();
+        }
+        return m_valid ? iterator(this) : end();
+    }
+
+    iterator end() {
+        return iterator();
+    }
+
+private:
+    class Reader : public kyotocabinet::DB::Visitor {
+    public:
+        Reader(std::string prefix, std::string end)
+        : m_prefix(std::move(prefix)), m_end(std::move(end)) {}
+
+        const char *visit_full(const char *kbuf, size_t ksiz,
+                   const char *vbuf, size_t vsiz, size_t *sp) {
+            m_match = ksiz >= m_prefix.size() &&
+                      !std::memcmp(kbuf, m_prefix.data(), m_prefix.size()) &&
+                      (m_end.empty() || std::string_view(kbuf, ksiz) < m_end);
+            if (m_match) {
+                m_key.assign(kbuf, ksiz);
+                m_value.assign(vbuf, vsiz);
+            }
+            return NOP;
+        }
+
+        const std::string &prefix() const {
+            return m_prefix;
+        }
+
+        bool read(kyotocabinet::DB::Cursor *cur) {
+            m_match = false;
+            return cur->accept(this, false, true) && m_match;
+        }
+
+        Record record() const {
+            return Record(m_key, m_value);
+        }
+
+    private:
+        std::string m_prefix;
+        std::string m_end;
+        std::string m_key;
+        std::string m_value;
+        bool m_match = false;
+    };
+
+    bool next() {
+        m_valid = m_reader.read(m_cur.get());
+        if (m_valid)
+            m_record = m_reader.record();
+        return m_valid;
+    }
+
+    std::unique_ptr<kyotocabinet::DB::Cursor> m_cur;
+    Reader m_reader;
+    std::string m_from;
+    Record m_record;
+    bool m_started = false;
+    bool m_valid = false;
+};
+
+}
+
+#endif
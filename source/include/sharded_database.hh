@@ -0,0 +1,545 @@
+#ifndef LIBINV_SHARDED_DATABASE_HH
+#define LIBINV_SHARDED_DATABASE_HH
+#include <kcpolydb.h>
+#include <kcutil.h>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <exception>
+#include <stdexcept>
+#include "database.hh"
+#include "key.hh"
+
+/* google coding style */
+
+namespace inventory {
+
+namespace util {
+    // "inventory.kct" -> "inventory.3.kct"
+    inline std::string shard_file(const std::string &file, size_t shard) {
+        size_t slash = file.rfind('/');
+        size_t dot = file.rfind('.');
+        if (dot == std::string::npos || dot == 0 ||
+                (slash != std::string::npos && dot < slash)) {
+            return file + "." + std::to_string(shard);
+        }
+        return file.substr(0, dot) + "." + std::to_string(shard)
+                                                  + file.substr(dot);
+    }
+}
+
+// impl() of a ShardedDatabase. Looks like a single Kyoto Cabinet database
+// to the mixins, forwarding each call to the shard owning the key.
+template<class kdb>
+class ShardRouter {
+public:
+    // A cursor is bound to a shard by a keyed jump(). Mixin scans never
+    // leave the prefix of one object, so they see all of its records.
+    // jump() and jump_back() without a key chain the shards instead: the
+    // walk visits every record, shard after shard, not in global key order.
+    class Cursor : public kyotocabinet::DB::Cursor {
+    public:
+        typedef kyotocabinet::DB::Visitor Visitor;
+
+        Cursor(ShardRouter &router)
+        : m_router(router) {}
+
+        bool jump() {
+            m_chain = 1;
+            bind(0);
+            return m_cur->jump() || next_shard();
+        }
+
+        bool jump(const char *kbuf, size_t ksiz) {
+            m_chain = 0;
+            bind(m_router.shard(kbuf, ksiz));
+            return m_cur->jump(kbuf, ksiz);
+        }
+
+        bool jump(const std::string &key) {
+            return jump(key.data(), key.size());
+        }
+
+        bool jump_back() {
+            m_chain = -1;
+            bind(m_router.shards() - 1);
+            return m_cur->jump_back() || next_shard();
+        }
+
+        bool jump_back(const char *kbuf, size_t ksiz) {
+            m_chain = 0;
+            bind(m_router.shard(kbuf, ksiz));
+            return m_cur->jump_back(kbuf, ksiz);
+        }
+
+        bool jump_back(const std::string &key) {
+            return jump_back(key.data(), key.size());
+        }
+
+        bool step() {
+            return chain([&] { return m_cur->step(); });
+        }
+
+        bool step_back() {
+            return chain([&] { return m_cur->step_back(); });
+        }
+
+        bool accept(Visitor *visitor, bool writable = true, bool step = false) {
+            return chain([&] {
+                return m_cur->accept(visitor, writable, step);
+            });
+        }
+
+        bool set_value(const char *vbuf, size_t vsiz, bool step = false) {
+            return chain([&] { return m_cur->set_value(vbuf, vsiz, step); });
+        }
+
+        bool set_value_str(const std::string &value, bool step = false) {
+            return chain([&] { return m_cur->set_value_str(value, step); });
+        }
+
+        bool remove() {
+            return chain([&] { return m_cur->remove(); });
+        }
+
+        char *get_key(size_t *sp, bool step = false) {
+            return chain([&] { return m_cur->get_key(sp, step); });
+        }
+
+        bool get_key(std::string *key, bool step = false) {
+            return chain([&] { return m_cur->get_key(key, step); });
+        }
+
+        char *get_value(size_t *sp, bool step = false) {
+            return chain([&] { return m_cur->get_value(sp, step); });
+        }
+
+        bool get_value(std::string *value, bool step = false) {
+            return chain([&] { return m_cur->get_value(value, step); });
+        }
+
+        char *get(size_t *ksp, const char **vbp, size_t *vsp,
+                                          bool step = false) {
+            return chain([&] { return m_cur->get(ksp, vbp, vsp, step); });
+        }
+
+        bool get(std::string *key, std::string *value, bool step = false) {
+            return chain([&] { return m_cur->get(key, value, step); });
+        }
+
+        kyotocabinet::DB *db() {
+            return m_cur ? m_cur->db() : nullptr;
+        }
+
+    private:
+        void bind(size_t shard) {
+            m_shard = shard;
+            m_cur.reset(m_router.at(shard).cursor());
+        }
+
+        // Retries f on the following shards while a chained walk runs off
+        // the end of one.
+        template<class F>
+        auto chain(F f) -> decltype(f()) {
+            if (!m_cur)
+                return decltype(f())();
+            for (;;) {
+                auto ret = f();
+                if (ret || !next_shard())
+                    return ret;
+            }
+        }
+
+        bool next_shard() {
+            using kyotocabinet::BasicDB;
+            if (!m_chain || m_router.at(m_shard).error().code() !=
+                                                  BasicDB::Error::NOREC)
+                return false;
+            for (;;) {
+                if (m_chain > 0 ? m_shard + 1 >= m_router.shards()
+                                : m_shard == 0)
+                    return false;
+                bind(m_chain > 0 ? m_shard + 1 : m_shard - 1);
+                if (m_chain > 0 ? m_cur->jump() : m_cur->jump_back())
+                    return true;
+            }
+        }
+
+        ShardRouter &m_router;
+        std::unique_ptr<typename kdb::Cursor> m_cur;
+        size_t m_shard = 0;
+        // direction of a walk over all shards, 0 for a keyed jump
+        int m_chain = 0;
+    };
+
+    ShardRouter(std::vector<std::unique_ptr<kdb>> &shards)
+    : m_shards(shards) {}
+
+    size_t shards() const {
+        return m_shards.size();
+    }
+
+    size_t shard(const char *key, size_t size) const {
+        size_t owner = util::owner_length(key, size);
+        return kyotocabinet::hashmurmur(key, owner) % m_shards.size();
+    }
+
+    size_t shard(const std::string &key) const {
+        return shard(key.data(), key.size());
+    }
+
+    kdb &at(size_t shard) {
+        return *m_shards[shard];
+    }
+
+    kdb &route(const std::string &key) {
+        last_shard() = shard(key);
+        return at(last_shard());
+    }
+
+    bool get(const std::string &key, std::string *value) {
+        return route(key).get(key, value);
+    }
+
+    bool set(const std::string &key, const std::string &value) {
+        return route(key).set(key, value);
+    }
+
+    bool remove(const std::string &key) {
+        return route(key).remove(key);
+    }
+
+    int32_t check(const std::string &key) {
+        return route(key).check(key);
+    }
+
+    Cursor *cursor() {
+        return new Cursor(*this);
+    }
+
+    // error of the shard this thread used last
+    typename kdb::Error error() {
+        return at(last_shard() % m_shards.size()).error();
+    }
+
+private:
+    static size_t &last_shard() {
+        thread_local size_t shard = 0;
+        return shard;
+    }
+
+    std::vector<std::unique_ptr<kdb>> &m_shards;
+};
+
+// Spreads the records of a datamodel over several database files by
+// hashing the IndexKey of the owning object, so writes to different
+// objects run in parallel in Kyoto Cabinet.
+//
+// All records of an object share a shard. The inverted link of an
+// association belongs to the remote object and therefore often to another
+// shard; apply() keeps a transaction open on every shard a batch touches
+// and commits them in shard order. A batch is atomic on each shard, but a
+// crash between two shard commits may leave a link without its inverse.
+template<class kdb = kyotocabinet::TreeDB>
+class ShardedDatabase {
+public:
+    typedef ShardRouter<kdb> Impl;
+
+    static constexpr bool ordered = Backend<kdb>::ordered;
+    static constexpr bool persistent = Backend<kdb>::persistent;
+
+    // The shard count decides where keys route, so it's saved in a
+    // manifest next to the shard files when they're created. 0 takes the
+    // count from the manifest, or the number of cores for a new database;
+    // a count that doesn't match the manifest fails the open.
+    ShardedDatabase(size_t shards = 0)
+    : m_router(m_shards), m_requested(shards) {}
+
+    ~ShardedDatabase() {
+        close();
+    }
+
+    // file names get the shard number inserted before the extension; shards
+    // are opened in parallel
+    void open(std::string file, const DatabaseOptions &options = {}) {
+        size_t count = shard_count(file, options);
+        m_shards.clear();
+        for (size_t i = 0; i < count; i++)
+            m_shards.emplace_back(new kdb);
+
+        std::vector<std::exception_ptr> errors(m_shards.size());
+        m_filters.resize(m_shards.size());
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < m_shards.size(); i++) {
+            threads.emplace_back([this, &file, &options, &errors, i] {
+                try {
+                    open_shard(i, util::shard_file(file, i), options);
+                } catch (...) {
+                    errors[i] = std::current_exception();
+                }
+            });
+        }
+        for (std::thread &thread : threads)
+            thread.join();
+
+        m_options = options;
+        for (std::exception_ptr &error : errors) {
+            if (error) {
+                close();
+                std::rethrow_exception(error);
+            }
+        }
+        if (options.object_cache && !options.read_only)
+            m_cache.reset(new ObjectCache(options.object_cache));
+    }
+
+    void close() {
+        disable_group_commit();
+        for (size_t i = 0; i < m_filters.size(); i++) {
+            if (m_filters[i])
+                m_filters[i]->close(*m_shards[i]);
+        }
+        for (auto &shard : m_shards)
+            shard->close();
+        m_cache.reset();
+        m_filters.clear();
+    }
+
+    void clear() {
+        for (auto &shard : m_shards)
+            shard->clear();
+        if (m_cache)
+            m_cache->clear();
+        for (auto &filter : m_filters) {
+            if (filter)
+                filter->clear();
+        }
+    }
+
+    // index records are owned by themselves, so each shard filters its own
+    bool may_exist(const std::string &key) const {
+        if (m_filters.empty())
+            return true;
+        const auto &filter = m_filters[m_router.shard(key)];
+        return !filter || filter->may_contain(key);
+    }
+
+    ObjectCache *cache() {
+        return m_cache.get();
+    }
+
+    void enable_group_commit(SyncPolicy policy = SyncPolicy::NONE,
+             std::chrono::milliseconds interval = std::chrono::milliseconds(0)) {
+        check_writable();
+        disable_group_commit();
+        m_writer.reset(new GroupCommitWriter<ShardedDatabase>(*this, policy,
+                                                              interval));
+    }
+
+    void disable_group_commit() {
+        m_writer.reset();
+    }
+
+    GroupCommitWriter<ShardedDatabase> *group_commit() {
+        return m_writer.get();
+    }
+
+    bool synchronize(bool hard = false) {
+        bool synced = true;
+        for (auto &shard : m_shards)
+            synced = shard->synchronize(hard) && synced;
+        return synced;
+    }
+
+    Impl &impl() {
+        return m_router;
+    }
+
+    // all records under a prefix belong to one object, so to one shard
+    PrefixScan scan(const std::string &prefix,
+                    const std::string &from = std::string(),
+                    const std::string &end = std::string()) {
+        static_assert(Backend<kdb>::ordered,
+                      "Prefix scans need an ordered backend");
+        return PrefixScan(m_router.cursor(), prefix, from, end);
+    }
+
+    // The records of the object owner, with few of the objects whose id
+    // starts with its own in between.
+    PrefixScan object_scan(const std::string &owner) {
+        return scan(owner, std::string(), util::owner_end(owner));
+    }
+
+    size_t shards() const {
+        return m_shards.size();
+    }
+
+    // Transactions are begun in shard order, so concurrent batches can't
+    // deadlock on each other.
+    void apply(const WriteOpMap &ops) {
+        using namespace kyotocabinet;
+
+        if (ops.empty())
+            return;
+        check_writable();
+
+        std::vector<WriteOpMap> parts(m_shards.size());
+        for (const auto &op : ops)
+            parts[m_router.shard(op.first)].insert(op);
+
+        std::vector<kdb *> begun;
+        auto abort = [&begun](const std::string &message) {
+            for (kdb *shard : begun)
+                shard->end_transaction(false);
+            throw std::runtime_error(message);
+        };
+
+        for (size_t i = 0; i < parts.size(); i++) {
+            if (parts[i].empty())
+                continue;
+
+            kdb &shard = *m_shards[i];
+            if (!shard.begin_transaction()) {
+                abort(std::string("Couldn't begin transaction: ")
+                                        + shard.error().message());
+            }
+            begun.push_back(&shard);
+
+            for (const auto &op : parts[i]) {
+                bool done;
+                if (op.second.remove) {
+                    done = shard.remove(op.first) ||
+                           shard.error().code() == BasicDB::Error::NOREC;
+                } else {
+                    done = shard.set(op.first,
+                                op_value(shard, op.first, op.second));
+                    if (done && m_filters[i])
+                        m_filters[i]->insert(op.first);
+                }
+
+                if (!done) {
+                    abort("Couldn't write " + op.first + " ("
+                                    + shard.error().message() + ")");
+                }
+            }
+        }
+
+        std::string failed;
+        for (kdb *shard : begun) {
+            if (!shard->end_transaction(true) && failed.empty())
+                failed = shard->error().message();
+        }
+        if (m_cache)
+            m_cache->invalidate(ops);
+        if (!failed.empty()) {
+            throw std::runtime_error("Couldn't commit transaction: "
+                                                           + failed);
+        }
+    }
+
+    const DatabaseOptions &options() const {
+        return m_options;
+    }
+
+    bool read_only() const {
+        return m_options.read_only;
+    }
+
+    std::shared_lock<std::shared_mutex> read_lock(std::shared_mutex &mutex) {
+        if (read_only())
+            return std::shared_lock<std::shared_mutex>(mutex, std::defer_lock);
+        return std::shared_lock<std::shared_mutex>(mutex);
+    }
+
+protected:
+    static std::string manifest_file(const std::string &file) {
+        return file + ".shards";
+    }
+
+    // shard count from the manifest, written first for a new database
+    size_t shard_count(const std::string &file,
+                       const DatabaseOptions &options) const {
+        size_t count = m_requested;
+        if (!persistent)
+            return count ? count : default_shards();
+
+        const std::string manifest = manifest_file(file);
+        std::ifstream in(manifest);
+        if (in) {
+            size_t saved = 0;
+            if (!(in >> saved) || !saved)
+                throw std::runtime_error("Bad shard manifest " + manifest);
+            if (count && count != saved) {
+                throw std::runtime_error(file + " has " +
+                    std::to_string(saved) + " shards, not " +
+                    std::to_string(count));
+            }
+            return saved;
+        }
+
+        if (options.read_only)
+            throw std::runtime_error("No shard manifest " + manifest);
+        // shards from before the manifest can't be routed by guesswork
+        if (!count && std::ifstream(util::shard_file(file, 0))) {
+            throw std::runtime_error("No shard manifest " + manifest +
+                                     "; open with the shard count");
+        }
+        if (!count)
+            count = default_shards();
+
+        const std::string tmp = manifest + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::trunc);
+            out << count << "\n";
+            if (!out.flush())
+                throw std::runtime_error("Couldn't write " + tmp);
+        }
+        if (std::rename(tmp.c_str(), manifest.c_str()) != 0)
+            throw std::runtime_error("Couldn't write " + manifest);
+        return count;
+    }
+
+    static size_t default_shards() {
+        size_t count = std::thread::hardware_concurrency();
+        return count ? count : 1;
+    }
+
+    void open_shard(size_t shard, const std::string &file,
+                          const DatabaseOptions &options) {
+        kdb &db = *m_shards[shard];
+        Backend<kdb>::tune(db, options);
+        uint32_t mode = options.read_only ? kdb::OREADER | kdb::ONOLOCK
+                                          : kdb::OWRITER | kdb::OCREATE;
+        if (!db.open(file, mode)) {
+            throw std::runtime_error("Couldn't open file: " + file + " ("
+                                        + db.error().message() + ")");
+        }
+        if (options.existence_filter && !options.read_only) {
+            m_filters[shard].reset(new ExistenceFilter);
+            m_filters[shard]->open(db, persistent ? file + ".exists" : "");
+        }
+    }
+
+    void check_writable() const {
+        if (read_only())
+            throw std::runtime_error("Database is read-only");
+    }
+
+    std::vector<std::unique_ptr<kdb>> m_shards;
+    Impl m_router;
+    const size_t m_requested;
+    DatabaseOptions m_options;
+    std::unique_ptr<GroupCommitWriter<ShardedDatabase>> m_writer;
+    std::unique_ptr<ObjectCache> m_cache;
+    std::vector<std::unique_ptr<ExistenceFilter>> m_filters;
+};
+
+typedef ShardedDatabase<kyotocabinet::TreeDB> ShardedTreeDatabase;
+
+}
+
+#endif
@@ -3,8 +3,10 @@
 #include <functional>
 #include <memory>
 #include <vector>
+#include <algorithm>
 #include "rpc.hh"
 #include "shared_wrapper.hh"
+#include "task_pool.hh"
 
 namespace inventory {
 
@@ -13,6 +15,23 @@ class SharedVector {
 public:
     typedef std::function<void(Shared<Type>)> ForeachCb;
 
+    // smallest share of a multi-get worth a task of its own
+    static const size_t kKeysPerThread = 32;
+
+    // Multi-get: the objects of keys, deduplicated and loaded in key order.
+    template<class Database>
+    static SharedVector<Type> load(Database &db, std::vector<IndexKey> keys) {
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+        SharedVector<Type> ret;
+        ret.m_vec.reserve(keys.size());
+        for (const IndexKey &key : keys)
+            ret.push_back(Shared<Type>(key));
+        ret.get(db);
+        return ret;
+    }
+
     void push_back(Shared<Type> object) {
         m_vec.push_back(object);
     }
@@ -50,6 +69,31 @@ public:
         bcreq->complete();
     }
 
+    // Loads every object from db, each with its own point reads. Large
+    // sets are split into contiguous runs of keys loaded as tasks on the
+    // shared pool.
+    template<class Database>
+    void get(Database &db) {
+        size_t runs = std::min(g_task_pool.size() + 1,
+                               m_vec.size() / kKeysPerThread);
+        if (runs < 2) {
+            for (Shared<Type> &obj : m_vec)
+                obj->get(db);
+            return;
+        }
+
+        std::vector<TaskPool::Task> tasks;
+        size_t run = (m_vec.size() + runs - 1) / runs;
+        for (size_t begin = 0; begin < m_vec.size(); begin += run) {
+            size_t end = std::min(begin + run, m_vec.size());
+            tasks.emplace_back([this, &db, begin, end] {
+                for (size_t i = begin; i < end; i++)
+                    m_vec[i]->get(db);
+            });
+        }
+        g_task_pool.run(std::move(tasks));
+    }
+
     int size() const {
         return m_vec.size();
     }
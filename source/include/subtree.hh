@@ -0,0 +1,308 @@
+#ifndef LIBINV_SUBTREE_HH
+#define LIBINV_SUBTREE_HH
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_set>
+#include <algorithm>
+#include "key.hh"
+#include "lock_table.hh"
+#include "task_pool.hh"
+
+/* google coding style */
+
+namespace inventory {
+
+// An up record value is the parent followed by its ancestors, each one
+// terminated by the up separator. A value without the terminator was
+// written before ancestor paths were kept and only names the parent.
+class HierarchyPath {
+public:
+    // Appends the ids held in value, nearest first; false for a value
+    // that only names the parent.
+    static bool split(std::string_view value, std::vector<IndexKey> *ovec) {
+        const char separator = HierarchyUpSeparator::string()[0];
+        if (value.empty() || value.back() != separator) {
+            ovec->emplace_back(std::string(value));
+            return false;
+        }
+
+        size_t begin = 0, end;
+        while ((end = value.find(separator, begin)) != std::string_view::npos) {
+            ovec->emplace_back(std::string(value.substr(begin, end - begin)));
+            begin = end + 1;
+        }
+        return true;
+    }
+
+    // Appends the ancestors of key, one point read plus one per level
+    // above an old style record.
+    template<class Database>
+    static void ancestors(Database &db, const IndexKey &key,
+                          std::vector<IndexKey> *ovec) {
+        std::unordered_set<std::string> seen({key.string()});
+        std::string current = key.string();
+        std::string value;
+        for (;;) {
+            {
+                auto lock = db.read_lock(g_object_locks.at(current));
+                HierarchyUpKey upkey(current);
+                if (!db.impl().get(upkey, &value))
+                    return;
+            }
+            if (split(value, ovec))
+                return;
+
+            current = ovec->back().string();
+            if (!seen.insert(current).second)
+                return;
+        }
+    }
+
+    // up record value of a child of key
+    template<class Database>
+    static std::string child_path(Database &db, const IndexKey &key) {
+        std::vector<IndexKey> ids({key});
+        ancestors(db, key, &ids);
+
+        std::string path;
+        for (const IndexKey &id : ids)
+            path += id.string() + HierarchyUpSeparator::string();
+        return path;
+    }
+};
+
+// Depth-first listing of the objects below a root over the hierarchy down
+// records, reading only keys. A page resumes after any node of the
+// subtree: the node's ancestor path gives the down sets to continue in.
+// Large pages walk the root's child subtrees as tasks on the shared pool.
+class SubtreeScan {
+public:
+    struct Node {
+        IndexKey key;
+        int depth;
+    };
+
+    static constexpr int kMaxDepth = 64;
+    // children read per scan of a down set
+    static constexpr size_t kChunk = 256;
+    // a page visits at most this many nodes per reported one, so a
+    // filter matching little doesn't make a page unbounded
+    static constexpr size_t kVisitFactor = 16;
+    // pages at least this large fan the root's children out to the pool
+    static constexpr size_t kParallelPage = 256;
+
+    int min_depth = 1;
+    int max_depth = kMaxDepth;
+    // reported types; all if empty. Other objects are still descended.
+    std::unordered_set<std::string> types;
+    size_t limit = 100;
+    // root children walked at once; 0 for the pool's workers plus the
+    // caller on pages of kParallelPage or more, one on smaller ones
+    size_t fanout = 0;
+
+    // One page of the subtree under root, resuming after the node cursor.
+    // next is set when the page was cut short (the page after it may come
+    // back empty). False if cursor isn't below root.
+    template<class Database>
+    bool page(Database &db, const IndexKey &root, const std::string &cursor,
+              std::vector<Node> *out, std::string *next) const {
+        out->clear();
+        next->clear();
+        std::vector<Frame> stack;
+        if (!resume(db, root, cursor, &stack))
+            return false;
+
+        size_t budget = limit * kVisitFactor;
+        std::string last;
+        // finish the subtrees the cursor was in, then the root's children
+        bool cut = walk(db, stack, 1, limit, out, &budget, &last);
+        size_t width = fanout ? fanout : limit >= kParallelPage ?
+                                         g_task_pool.size() + 1 : 1;
+        if (!cut && width < 2)
+            cut = walk(db, stack, 0, limit, out, &budget, &last);
+
+        while (!cut && width >= 2) {
+            std::vector<std::string> batch;
+            std::string child;
+            while (batch.size() < width && next_child(db, stack[0], &child))
+                batch.push_back(std::move(child));
+            if (batch.empty())
+                break;
+
+            std::vector<Subtree> subtrees = walk_subtrees(db, batch,
+                                         limit - out->size(), budget);
+            for (Subtree &subtree : subtrees) {
+                // walked past what the subtrees before it left over; the
+                // next page resumes with it
+                if (subtree.visited > budget) {
+                    cut = true;
+                    break;
+                }
+                for (Node &node : subtree.nodes) {
+                    out->push_back(std::move(node));
+                    last = out->back().key.string();
+                    if (out->size() == limit) {
+                        cut = true;
+                        break;
+                    }
+                }
+                if (cut)
+                    break;
+
+                last = subtree.last;
+                budget -= subtree.visited;
+                if (subtree.cut || !budget) {
+                    cut = true;
+                    break;
+                }
+            }
+        }
+
+        if (cut)
+            *next = last;
+        return true;
+    }
+
+private:
+    struct Frame {
+        Frame(std::string key, int depth)
+        : key(std::move(key)), depth(depth) {}
+
+        std::string key;
+        int depth;
+        // children up to and including this one are done
+        std::string from;
+        std::vector<std::string> children;
+        size_t pos = 0;
+        bool done = false;
+    };
+
+    struct Subtree {
+        std::vector<Node> nodes;
+        std::string last;
+        size_t visited = 0;
+        bool cut = false;
+    };
+
+    template<class Database>
+    bool resume(Database &db, const IndexKey &root, const std::string &cursor,
+                                           std::vector<Frame> *stack) const {
+        if (cursor.empty()) {
+            stack->emplace_back(root.string(), 0);
+            return true;
+        }
+
+        std::vector<IndexKey> path;
+        HierarchyPath::ancestors(db, IndexKey(cursor), &path);
+        auto it = std::find(path.begin(), path.end(), root);
+        if (it == path.end())
+            return false;
+
+        // root down to the cursor
+        std::vector<std::string> chain;
+        for (size_t i = it - path.begin() + 1; i-- > 0;)
+            chain.push_back(path[i].string());
+        chain.push_back(cursor);
+
+        for (size_t depth = 0; depth + 1 < chain.size(); depth++) {
+            stack->emplace_back(chain[depth], depth);
+            stack->back().from = chain[depth + 1];
+        }
+        int depth = chain.size() - 1;
+        if (depth < max_depth)
+            stack->emplace_back(cursor, depth);
+        return true;
+    }
+
+    template<class Database>
+    static bool next_child(Database &db, Frame &frame, std::string *child) {
+        if (frame.pos == frame.children.size()) {
+            if (frame.done)
+                return false;
+
+            frame.children.clear();
+            frame.pos = 0;
+            const std::string prefix = HierarchyDownKey::prefix(frame.key);
+            auto lock = db.read_lock(g_object_locks.at(frame.key));
+            for (const auto &record : db.scan(prefix, frame.from.empty() ?
+                                      std::string() : prefix + frame.from)) {
+                HierarchyDownKeyView dkey(record.first);
+                if (!dkey.good() || dkey.remote_part() == frame.from)
+                    continue;
+                if (frame.children.size() == kChunk)
+                    break;
+                frame.children.emplace_back(dkey.remote_part());
+            }
+            frame.done = frame.children.size() < kChunk;
+            if (frame.children.empty())
+                return false;
+            frame.from = frame.children.back();
+        }
+        *child = frame.children[frame.pos++];
+        return true;
+    }
+
+    // Reports node if it passes the filters and queues its children.
+    // True when max_out or the visit budget is used up.
+    bool visit(std::string key, int depth, std::vector<Frame> &stack,
+               size_t max_out, std::vector<Node> *out, size_t *budget,
+                                                 std::string *last) const {
+        *last = key;
+        (*budget)--;
+        if (depth >= min_depth && (types.empty() ||
+                types.count(std::string(IndexKeyView(key).type_part()))))
+            out->push_back({IndexKey(key), depth});
+        if (depth < max_depth)
+            stack.emplace_back(std::move(key), depth);
+        return out->size() == max_out || !*budget;
+    }
+
+    // Depth-first until the stack is down to floor frames; true when cut
+    // short.
+    template<class Database>
+    bool walk(Database &db, std::vector<Frame> &stack, size_t floor,
+              size_t max_out, std::vector<Node> *out, size_t *budget,
+                                              std::string *last) const {
+        std::string child;
+        while (stack.size() > floor) {
+            if (!next_child(db, stack.back(), &child)) {
+                stack.pop_back();
+                continue;
+            }
+            int depth = stack.back().depth + 1;
+            if (visit(std::move(child), depth, stack, max_out, out, budget,
+                                                                    last))
+                return true;
+        }
+        return false;
+    }
+
+    // The subtrees of the root's children in keys, one task each, every
+    // one allowed the whole remaining page.
+    template<class Database>
+    std::vector<Subtree> walk_subtrees(Database &db,
+                       const std::vector<std::string> &keys, size_t max_out,
+                                                      size_t budget) const {
+        std::vector<Subtree> subtrees(keys.size());
+        std::vector<TaskPool::Task> tasks;
+        for (size_t i = 0; i < keys.size(); i++) {
+            tasks.emplace_back([&, i] {
+                Subtree &subtree = subtrees[i];
+                std::vector<Frame> stack;
+                size_t left = budget;
+                subtree.cut = visit(keys[i], 1, stack, max_out,
+                                    &subtree.nodes, &left, &subtree.last) ||
+                              walk(db, stack, 0, max_out, &subtree.nodes,
+                                                 &left, &subtree.last);
+                subtree.visited = budget - left;
+            });
+        }
+        g_task_pool.run(std::move(tasks));
+        return subtrees;
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,140 @@
+#ifndef LIBINV_TASK_POOL_HH
+#define LIBINV_TASK_POOL_HH
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <exception>
+#include <algorithm>
+
+/* google coding style */
+
+namespace inventory {
+
+// Fixed set of worker threads shared by the parallel reads of all
+// requests, so concurrent RPCs queue for the same workers instead of each
+// starting its own. The calling thread works on its own tasks too, so a
+// run finishes even with every worker busy and runs may nest.
+class TaskPool {
+public:
+    typedef std::function<void()> Task;
+
+    // workers: 0 for one per hardware thread; started on first use
+    TaskPool(size_t workers = 0)
+    : m_size(workers ? workers :
+             std::max(1u, std::thread::hardware_concurrency())) {}
+
+    ~TaskPool() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cv.notify_all();
+        for (std::thread &worker : m_workers)
+            worker.join();
+    }
+
+    size_t size() const {
+        return m_size;
+    }
+
+    // Runs tasks on the calling thread and up to size() workers and
+    // returns once all are done, rethrowing the first exception thrown.
+    void run(std::vector<Task> tasks) {
+        if (tasks.empty())
+            return;
+
+        auto group = std::make_shared<Group>(std::move(tasks));
+        size_t helpers = std::min(m_size, group->tasks.size() - 1);
+        if (helpers) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            start();
+            for (size_t i = 0; i < helpers; i++)
+                m_queue.push_back(group);
+            m_cv.notify_all();
+        }
+
+        work(*group);
+        std::unique_lock<std::mutex> lock(group->mutex);
+        group->cv.wait(lock, [&group] {
+            return group->done == group->tasks.size();
+        });
+        if (group->error)
+            std::rethrow_exception(group->error);
+    }
+
+private:
+    struct Group {
+        Group(std::vector<Task> tasks)
+        : tasks(std::move(tasks)) {}
+
+        std::vector<Task> tasks;
+        std::atomic<size_t> next{0};
+        std::mutex mutex;
+        std::condition_variable cv;
+        size_t done = 0;
+        std::exception_ptr error;
+    };
+
+    // takes tasks of group until none are left
+    static void work(Group &group) {
+        size_t i;
+        while ((i = group.next++) < group.tasks.size()) {
+            std::exception_ptr error;
+            try {
+                group.tasks[i]();
+            } catch (...) {
+                error = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> lock(group.mutex);
+            if (error && !group.error)
+                group.error = error;
+            if (++group.done == group.tasks.size())
+                group.cv.notify_all();
+        }
+    }
+
+    // with m_mutex held
+    void start() {
+        if (!m_workers.empty())
+            return;
+        for (size_t i = 0; i < m_size; i++)
+            m_workers.emplace_back(&TaskPool::worker_impl, this);
+    }
+
+    void worker_impl() {
+        for (;;) {
+            std::shared_ptr<Group> group;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cv.wait(lock, [this] {
+                    return m_stop || !m_queue.empty();
+                });
+                if (m_queue.empty())
+                    return;
+                group = std::move(m_queue.front());
+                m_queue.pop_front();
+            }
+            work(*group);
+        }
+    }
+
+    const size_t m_size;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<std::shared_ptr<Group>> m_queue;
+    std::vector<std::thread> m_workers;
+    bool m_stop = false;
+};
+
+// runs the parallel parts of multi-gets and subtree scans
+extern TaskPool g_task_pool;
+
+}
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef LIBINV_WRITE_BATCH_HH
+#define LIBINV_WRITE_BATCH_HH
+#include <string>
+#include <map>
+#include <vector>
+#include <future>
+#include <mutex>
+#include <shared_mutex>
+#include <algorithm>
+#include <functional>
+#include "lock_table.hh"
+
+/* google coding style */
+
+namespace inventory {
+
+// A record write staged by WriteBatch. A merge computes the value from
+// the stored one (nullptr if missing) when the write is applied, inside
+// the transaction and under the stripes the batch holds; it must not
+// throw.
+struct WriteOp {
+    typedef std::function<std::string(const std::string *)> Merge;
+
+    bool remove;
+    std::string value;
+    Merge merge;
+};
+
+// Staged writes keyed by record; a later write to the same key replaces
+// an earlier one.
+typedef std::map<std::string, WriteOp> WriteOpMap;
+
+// Stages op for key; a merge onto an earlier write of the same key is
+// applied to that write's result.
+inline void stage(WriteOpMap &ops, const std::string &key, WriteOp op) {
+    auto it = ops.find(key);
+    if (it != ops.end() && op.merge) {
+        WriteOp prior = std::move(it->second);
+        WriteOp::Merge merge = std::move(op.merge);
+        op.merge = [prior, merge](const std::string *stored) {
+            if (prior.remove)
+                return merge(nullptr);
+            if (!prior.merge)
+                return merge(&prior.value);
+            std::string value = prior.merge(stored);
+            return merge(&value);
+        };
+    }
+    ops[key] = std::move(op);
+}
+
+// The value a set or merge op writes; a merge reads the stored record
+// from db.
+template<class kdb>
+std::string op_value(kdb &db, const std::string &key, const WriteOp &op) {
+    if (!op.merge)
+        return op.value;
+    std::string stored;
+    return db.get(key, &stored) ? op.merge(&stored) : op.merge(nullptr);
+}
+
+// Collects the writes of one commit across the object and all of its
+// mixins and applies them atomically. Mixins register the lock table
+// guarding their records with lock(); the stripes of the owners of all
+// written records are taken in address order for the duration of the
+// write only, so batches spanning two objects can't deadlock.
+template<class Database>
+class WriteBatch {
+public:
+    WriteBatch(Database &db)
+    : m_db(db) {}
+
+    void set(const std::string &key, const std::string &value) {
+        m_ops[key] = {false, value};
+    }
+
+    void remove(const std::string &key) {
+        m_ops[key] = {true, std::string()};
+    }
+
+    // read-modify-write of key at apply time, see WriteOp
+    void merge(const std::string &key, WriteOp::Merge merge) {
+        stage(m_ops, key, {false, std::string(), std::move(merge)});
+    }
+
+    void lock(LockTable &table) {
+        if (std::find(m_tables.begin(), m_tables.end(), &table) ==
+                                                     m_tables.end()) {
+            m_tables.push_back(&table);
+        }
+    }
+
+    // Keeps mutex locked until the batch is committed or dropped, for
+    // writes computed from reads that mustn't change in between. Taken
+    // before the stripes; holding a mutex again is a no-op.
+    void hold(std::shared_mutex &mutex, bool exclusive) {
+        for (const auto &lock : m_held) {
+            if (lock.mutex() == &mutex)
+                return;
+        }
+        for (const auto &lock : m_held_shared) {
+            if (lock.mutex() == &mutex)
+                return;
+        }
+        if (exclusive)
+            m_held.emplace_back(mutex);
+        else
+            m_held_shared.emplace_back(mutex);
+    }
+
+    const WriteOpMap &ops() const {
+        return m_ops;
+    }
+
+    bool empty() const {
+        return m_ops.empty();
+    }
+
+    void clear() {
+        m_ops.clear();
+        m_tables.clear();
+        m_held.clear();
+        m_held_shared.clear();
+    }
+
+    // With a group-commit writer attached to the database the write is
+    // handed over to it; the locks are released once the ops are visible,
+    // then commit() waits for them to become durable.
+    void commit() {
+        std::vector<std::shared_mutex *> locks;
+        for (LockTable *table : m_tables) {
+            for (const auto &op : m_ops)
+                locks.push_back(&table->at(op.first));
+        }
+        std::sort(locks.begin(), locks.end());
+        locks.erase(std::unique(locks.begin(), locks.end()), locks.end());
+
+        std::future<void> durable;
+        {
+            std::vector<std::unique_lock<std::shared_mutex>> held;
+            for (std::shared_mutex *mutex : locks)
+                held.emplace_back(*mutex);
+
+            auto writer = m_db.group_commit();
+            if (writer) {
+                auto ticket = writer->submit(m_ops);
+                ticket.applied.get();
+                durable = std::move(ticket.durable);
+            } else {
+                m_db.apply(m_ops);
+            }
+        }
+        clear();
+
+        if (durable.valid())
+            durable.get();
+    }
+
+private:
+    Database &m_db;
+    WriteOpMap m_ops;
+    std::vector<LockTable *> m_tables;
+    std::vector<std::unique_lock<std::shared_mutex>> m_held;
+    std::vector<std::shared_lock<std::shared_mutex>> m_held_shared;
+};
+
+}
+
+#endif
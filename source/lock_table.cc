@@ -0,0 +1,6 @@
+#include "lock_table.hh"
+
+namespace inventory {
+    LockTable g_object_locks;
+    std::shared_mutex g_hierarchy_lock;
+}
@@ -1,7 +0,0 @@
-#include "object.hh"
-#include <mutex>
-#include <shared_mutex>
-
-namespace inventory {
-    std::shared_mutex g_object_rwlock;
-}
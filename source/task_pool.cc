@@ -0,0 +1,5 @@
+#include "task_pool.hh"
+
+namespace inventory {
+    TaskPool g_task_pool;
+}
@@ -0,0 +1,65 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+#include "stdtypes.hh"
+#include "rpc.hh"
+
+// Times the lookup of an object RPC method: the per-roster search with a
+// NoSuchMethod exception per miss that rpc_call used to do, against the
+// method table. Prints ns per lookup; there's nothing to assert.
+
+using namespace std;
+using namespace inventory;
+
+typedef types::Item<> Item;
+typedef Database<> DB;
+
+template<class Mixin>
+static const void *roster_find(const string &name) {
+    try {
+        return &RPC::MethodRoster<DB, Mixin>::rpc_method_get(name);
+    } catch (RPC::exceptions::NoSuchMethod &e) {
+        return nullptr;
+    }
+}
+
+static const void *legacy_find(const string &name) {
+    const void *method = roster_find<Item>(name);
+    if (!method)
+        method = roster_find<Association<DB, Item>>(name);
+    if (!method)
+        method = roster_find<Container<DB, Item>>(name);
+    if (!method)
+        method = roster_find<Hierarchical<DB, Item>>(name);
+    return method;
+}
+
+template<class F>
+static double ns_per_call(int iterations, F f) {
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+        f();
+    chrono::duration<double, nano> elapsed = chrono::steady_clock::now()
+                                                                 - start;
+    return elapsed.count() / iterations;
+}
+
+int main(int argc, char **argv) {
+    const int iterations = argc > 1 ? stoi(argv[1]) : 1000000;
+    const auto &table = Item::rpc_method_table();
+
+    volatile const void *sink;
+    for (const string name : {"repr.get", "attribute.get",
+                              "hierarchical.hierarchy", "no.such.method"}) {
+        double legacy = ns_per_call(iterations, [&] {
+            sink = legacy_find(name);
+        });
+        double hashed = ns_per_call(iterations, [&] {
+            sink = table.find(name);
+        });
+        cout << name << ": rosters " << legacy << " ns, method table "
+             << hashed << " ns" << endl;
+    }
+    (void)sink;
+    return 0;
+}
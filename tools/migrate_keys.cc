@@ -0,0 +1,44 @@
+#include <iostream>
+#include <string>
+#include <stdexcept>
+#include <kcpolydb.h>
+#include "key_codec.hh"
+
+// Copies a database with separator-joined keys into a new TreeDB file
+// with binary keys, to be opened as a CompactTreeDatabase.
+
+using namespace inventory;
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        std::cerr << "usage: " << argv[0] << " <from.kct> <to.kct>"
+                                                       << std::endl;
+        return 1;
+    }
+
+    kyotocabinet::TreeDB from;
+    if (!from.open(argv[1], kyotocabinet::TreeDB::OREADER)) {
+        std::cerr << "Couldn't open " << argv[1] << " ("
+                  << from.error().message() << ")" << std::endl;
+        return 1;
+    }
+
+    BinaryKeyDB<kyotocabinet::TreeDB> to;
+    if (!to.open(argv[2], kyotocabinet::TreeDB::OWRITER |
+                          kyotocabinet::TreeDB::OCREATE |
+                          kyotocabinet::TreeDB::OTRUNCATE)) {
+        std::cerr << "Couldn't open " << argv[2] << " ("
+                  << to.error().message() << ")" << std::endl;
+        return 1;
+    }
+
+    try {
+        int64_t count = migrate_keys(from, to);
+        std::cout << count << " records migrated" << std::endl;
+    } catch (std::runtime_error &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return to.close() && from.close() ? 0 : 1;
+}
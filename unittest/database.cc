@@ -0,0 +1,756 @@
+#include <assert.h>
+#include <gtest/gtest.h>
+#include <iostream>
+#include <thread>
+#include "stdtypes.hh"
+#include "database.hh"
+#include "sharded_database.hh"
+#include "key_codec.hh"
+
+using namespace std;
+using namespace inventory;
+
+static int g_argc;
+static char **g_argv;
+
+class DatabaseTest : public ::testing::Test {
+public:
+    DatabaseTest() {
+        DatabaseOptions options;
+        options.page_cache = 64 << 20;
+        m_db.open(g_argv[1], options);
+    }
+
+    virtual void SetUp() {}
+    virtual void TearDown() {}
+
+    Database<> m_db;
+};
+
+TEST_F(DatabaseTest, tuned_tree) {
+    types::Item<> item;
+    item["testattr"] = "test";
+    item.commit(m_db);
+
+    types::Item<> loaded;
+    loaded.get(m_db, item.id());
+    EXPECT_EQ(item.repr_string(), loaded.repr_string());
+}
+
+TEST_F(DatabaseTest, single_pass_get) {
+    types::Category<> tool("tool"), tools("tools");
+    tool["a"] = "1";
+    tools["a"] = "2";
+    tools["b"] = "3";
+    tool.commit(m_db);
+    tools.commit(m_db);
+
+    types::Category<> loaded;
+    loaded.get(m_db, "tool");
+    EXPECT_EQ(loaded.attributes().size(), 1);
+    EXPECT_EQ(loaded.attributes().at("a"), "1");
+
+    // the scan ends before the rows of ids extended by a letter
+    types::Category<> toolbox("toolbox");
+    for (int i = 0; i < 100; i++)
+        toolbox[to_string(i)] = "x";
+    toolbox.commit(m_db);
+    size_t rows = 0;
+    for (const auto &record : m_db.object_scan(tool.path().string())) {
+        EXPECT_EQ(util::owner_length(record.first.data(),
+                                     record.first.size()),
+                  tool.path().string().size());
+        rows++;
+    }
+    EXPECT_EQ(rows, 2);
+
+    // a get replaces local changes rather than queueing them for commit
+    loaded["b"] = "local";
+    loaded.get(m_db, "tool");
+    EXPECT_FALSE(loaded.modified());
+    EXPECT_EQ(loaded.attributes().count("b"), 0);
+
+    // an id holding a separator would alias another object's records
+    EXPECT_THROW(types::Category<>("tool.a"), std::runtime_error);
+    EXPECT_THROW(loaded.get(m_db, "tool*x"), std::runtime_error);
+}
+
+TEST_F(DatabaseTest, object_cache) {
+    Database<> db;
+    DatabaseOptions options;
+    options.object_cache = 1 << 20;
+    db.open(string(g_argv[1]) + ".cache", options);
+
+    types::Item<> item;
+    item["name"] = "first";
+    item.commit(db);
+
+    for (int i = 0; i < 2; i++) {
+        types::Item<> loaded;
+        loaded.get(db, item.id());
+        EXPECT_EQ(loaded.attributes().at("name"), "first");
+    }
+    EXPECT_EQ(db.cache()->stats().misses, 1);
+    EXPECT_EQ(db.cache()->stats().hits, 1);
+
+    item["name"] = "second";
+    item.commit(db);
+
+    types::Item<> loaded;
+    loaded.get(db, item.id());
+    EXPECT_EQ(loaded.attributes().at("name"), "second");
+    db.clear();
+}
+
+TEST_F(DatabaseTest, existence_filter) {
+    string file = string(g_argv[1]) + ".exists.kct";
+    DatabaseOptions options;
+    options.existence_filter = true;
+
+    types::Item<> item;
+    {
+        Database<> db;
+        db.open(file, options);
+        item.commit(db);
+        EXPECT_TRUE(item.exists(db));
+        EXPECT_TRUE(db.may_exist(item.path()));
+        EXPECT_FALSE(db.may_exist(IndexKey({item.type(), "nonexistent"})));
+    }
+
+    // reopened from the saved filter
+    Database<> db;
+    db.open(file, options);
+    EXPECT_TRUE(item.exists(db));
+    db.clear();
+    EXPECT_FALSE(item.exists(db));
+}
+
+TEST_F(DatabaseTest, existence_filter_growth) {
+    // each stage doubles, so the stages a lookup probes grow with log n
+    ExistenceFilter filter;
+    uint64_t keys = 0, capacity = ExistenceFilter::kInitialCapacity;
+    for (size_t stages = 1; stages <= 5; stages++, capacity *= 2) {
+        for (uint64_t end = keys + capacity; keys < end;)
+            filter.insert("Item:" + to_string(keys++));
+        EXPECT_EQ(filter.stages("Item"), stages);
+    }
+    EXPECT_TRUE(filter.may_contain("Item:0"));
+    EXPECT_TRUE(filter.may_contain("Item:" + to_string(keys - 1)));
+}
+
+TEST_F(DatabaseTest, global_index) {
+    // creations of different objects on two threads all reach the index
+    vector<thread> threads;
+    for (int t = 0; t < 2; t++) {
+        threads.emplace_back([this, t] {
+            for (int i = 0; i < 50; i++) {
+                types::Category<> category("global" + to_string(t) + "_" +
+                                                          to_string(i));
+                category.commit(m_db);
+            }
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+
+    string index;
+    ASSERT_TRUE(m_db.impl().get("Category", &index));
+    for (int t = 0; t < 2; t++) {
+        for (int i = 0; i < 50; i++) {
+            string key = "\"Category:global" + to_string(t) + "_" +
+                                                 to_string(i) + "\"";
+            EXPECT_NE(index.find(key), string::npos) << key;
+        }
+    }
+}
+
+TEST_F(DatabaseTest, lazy_get) {
+    types::Item<> item;
+    item["name"] = "first";
+    item.commit(m_db);
+
+    // nothing is read until the attributes are accessed
+    types::Item<> lazy;
+    lazy.get_lazy(m_db, item.id());
+    types::Item<> prefetched;
+    prefetched.prefetch<Container>(m_db, item.id());
+
+    item["name"] = "second";
+    item.commit(m_db);
+    EXPECT_EQ(lazy.attributes().at("name"), "second");
+    EXPECT_EQ(prefetched.attributes().at("name"), "first");
+    EXPECT_EQ(lazy.repr_string(), item.repr_string());
+}
+
+TEST_F(DatabaseTest, point_lookups) {
+    types::Item<> item;
+    item["a"] = "1";
+    Mode mode;
+    mode.set(USER, READ);
+    item.set_mode("handle", mode);
+    item.commit(m_db);
+
+    std::string value;
+    EXPECT_TRUE(item.get_attribute(m_db, "a", &value));
+    EXPECT_EQ(value, "1");
+    EXPECT_FALSE(item.get_attribute(m_db, "b", &value));
+    EXPECT_TRUE(item.access(m_db, "handle", USER, READ));
+    EXPECT_FALSE(item.access(m_db, "handle", USER, WRITE));
+}
+
+TEST_F(DatabaseTest, object_header) {
+    types::Item<> item;
+    Mode mode;
+    mode.set(USER, READ);
+    item.set_mode("handle", mode);
+    item.commit(m_db);
+    item.commit(m_db);
+
+    ObjectHeader header;
+    ASSERT_TRUE(item.get_header(m_db, &header));
+    EXPECT_EQ(header.version, 2);
+    EXPECT_EQ(header.mixins, types::Item<>::mixin_bits());
+    ASSERT_EQ(header.modes.size(), 1);
+    EXPECT_EQ(header.modes[0].second.string(), mode.string());
+
+    // objects committed before the header: empty index value, mode records
+    types::Item<> legacy;
+    m_db.impl().set(legacy.path(), "");
+    m_db.impl().set(ModeKey({legacy.path(), "handle"}), mode.string());
+    EXPECT_TRUE(legacy.access(m_db, "handle", USER, READ));
+
+    types::Item<> loaded;
+    loaded.get(m_db, legacy.id());
+    loaded.commit(m_db);
+    EXPECT_EQ(m_db.impl().check(ModeKey({legacy.path(), "handle"})), -1);
+    EXPECT_TRUE(loaded.access(m_db, "handle", USER, READ));
+}
+
+TEST_F(DatabaseTest, stale_header) {
+    Mode mode;
+    mode.set(USER, READ);
+    types::Item<> item;
+    item.set_mode("old", mode);
+    item.commit(m_db);
+
+    types::Item<> stale;
+    stale.get(m_db, item.id());
+    item.set_mode("new", mode);
+    item.remove_mode("old");
+    item.commit(m_db);
+
+    // an unrelated commit from an instance loaded before keeps the modes
+    stale["a"] = "1";
+    stale.commit(m_db);
+
+    ObjectHeader header;
+    ASSERT_TRUE(item.get_header(m_db, &header));
+    EXPECT_EQ(header.version, 3);
+    ASSERT_EQ(header.modes.size(), 1);
+    EXPECT_EQ(header.modes[0].first, "new");
+    EXPECT_EQ(stale.version(), 3);
+}
+
+TEST_F(DatabaseTest, authorizer) {
+    Mode user_list, group_list, other_read;
+    user_list.set(USER, LIST);
+    group_list.set(GROUP, LIST);
+    other_read.set(OTHER, READ);
+
+    vector<types::Item<>> items(5);
+    items[1].set_mode("alice", user_list);
+    items[2].set_mode("staff", group_list);
+    items[3].set_mode("bob", user_list);
+    items[4].set_mode("bob", other_read);
+    for (size_t i = 0; i < items.size(); i++)
+        items[i].commit(m_db);
+
+    vector<IndexKey> keys;
+    for (auto &item : items)
+        keys.push_back(item.path());
+    keys.push_back(IndexKey({"Item", "missing"}));
+
+    // credentials follow the groups the user comes with
+    vector<IndexKey> listed = keys;
+    g_authorizer.filter(m_db, User("alice"), listed, LIST);
+    EXPECT_EQ(listed.size(), 2);
+
+    User alice("alice", {"staff"});
+    g_authorizer.filter(m_db, alice, keys, LIST);
+    ASSERT_EQ(keys.size(), 3);
+    EXPECT_EQ(keys[0], items[0].path());
+    EXPECT_EQ(keys[1], items[1].path());
+    EXPECT_EQ(keys[2], items[2].path());
+
+    vector<string> groups;
+    g_authorizer.set_group_source([&groups](const string &handle) {
+        return handle == "carol" ? groups : vector<string>();
+    });
+    keys.resize(3);
+    listed = keys;
+    g_authorizer.filter(m_db, g_authorizer.user("carol"), listed, LIST);
+    EXPECT_EQ(listed.size(), 1);
+
+    groups.push_back("staff");
+    listed = keys;
+    g_authorizer.filter(m_db, g_authorizer.user("carol"), listed, LIST);
+    EXPECT_EQ(listed.size(), 2);
+    g_authorizer.set_group_source(nullptr);
+}
+
+template<class DB>
+static void check_link_ranges(DB &db) {
+    types::Item<DB> item;
+    vector<types::Picture<DB>> pictures(3);
+    vector<types::Item<DB>> items(2);
+    for (auto &picture : pictures)
+        item *= picture;
+    for (auto &other : items)
+        item *= other;
+    item.commit(db);
+
+    types::Item<DB> lazy;
+    lazy.get_lazy(db, item.id());
+    EXPECT_EQ(lazy.template assoc_ids<types::Picture<DB>>(db).size(), 3);
+    EXPECT_EQ(lazy.template assoc_ids<types::Item<DB>>(db).size(), 2);
+
+    string next;
+    auto first = lazy.link_page(db, "Picture", "", 2, &next);
+    ASSERT_EQ(first.size(), 2);
+    ASSERT_FALSE(next.empty());
+    auto second = lazy.link_page(db, "Picture", next, 2, &next);
+    ASSERT_EQ(second.size(), 1);
+    EXPECT_TRUE(next.empty());
+    EXPECT_EQ(second[0].type_part(), "Picture");
+    EXPECT_NE(second[0], first[1]);
+}
+
+TEST_F(DatabaseTest, link_ranges) {
+    check_link_ranges(m_db);
+
+    CompactTreeDatabase db;
+    db.open(string(g_argv[1]) + ".compact");
+    check_link_ranges(db);
+    db.clear();
+}
+
+TEST_F(DatabaseTest, multi_get) {
+    types::Item<> box;
+    vector<types::Item<>> contents(200);
+    for (size_t i = 0; i < contents.size(); i++) {
+        contents[i]["n"] = to_string(i);
+        box += contents[i];
+        contents[i].commit(m_db);
+    }
+    box.commit(m_db);
+
+    types::Item<> opened;
+    opened.get(m_db, box.id());
+    SharedVector<types::Item<>> down = opened.down(m_db);
+    ASSERT_EQ(down.size(), contents.size());
+    for (int i = 0; i < down.size(); i++) {
+        if (i)
+            EXPECT_LT(down.vec()[i - 1]->path(), down.vec()[i]->path());
+        EXPECT_TRUE(down.vec()[i]["n"].exists());
+        EXPECT_EQ(down.vec()[i]->up_id(), box.path().string());
+    }
+}
+
+TEST_F(DatabaseTest, graph_traverse) {
+    // root -> child -> grandchild down the hierarchy, root * picture,
+    // picture * other
+    types::Item<> root, child, grandchild, other;
+    types::Picture<> picture;
+    root += child;
+    child += grandchild;
+    root *= picture;
+    picture *= other;
+    for (auto *item : {&root, &child, &grandchild, &other})
+        item->commit(m_db);
+    picture.commit(m_db);
+
+    GraphTraversal traversal;
+    bool truncated;
+    auto nodes = traversal.run(m_db, root.path(), nullptr, &truncated);
+    ASSERT_EQ(nodes.size(), 2);
+    EXPECT_FALSE(truncated);
+
+    traversal.max_depth = 2;
+    nodes = traversal.run(m_db, root.path(), nullptr, &truncated);
+    ASSERT_EQ(nodes.size(), 4);
+    EXPECT_EQ(nodes[3].depth, 2);
+
+    traversal.types = {"Item"};
+    nodes = traversal.run(m_db, root.path(), nullptr, &truncated);
+    ASSERT_EQ(nodes.size(), 2);
+    EXPECT_EQ(nodes[1].key, grandchild.path());
+    EXPECT_EQ(nodes[1].via, child.path());
+
+    traversal.types.clear();
+    traversal.limit = 3;
+    nodes = traversal.run(m_db, root.path(), nullptr, &truncated);
+    EXPECT_EQ(nodes.size(), 3);
+    EXPECT_TRUE(truncated);
+
+    // a hub's links are read only as far as the cap and the visit budget
+    types::Item<> hub;
+    vector<types::Picture<>> pictures(100);
+    for (auto &linked : pictures)
+        hub *= linked;
+    hub.commit(m_db);
+    traversal.max_depth = 1;
+    traversal.limit = 2;
+    nodes = traversal.run(m_db, hub.path(), nullptr, &truncated);
+    EXPECT_EQ(nodes.size(), 2);
+    EXPECT_TRUE(truncated);
+    nodes = traversal.run(m_db, hub.path(),
+                          [](vector<IndexKey> &keys) { keys.clear(); },
+                          &truncated);
+    EXPECT_TRUE(nodes.empty());
+    EXPECT_TRUE(truncated);
+}
+
+TEST_F(DatabaseTest, ancestor_paths) {
+    types::Item<> room, shelf, box, bag, store;
+    room += shelf;
+    shelf += box;
+    box += bag;
+    for (auto *item : {&room, &shelf, &box, &bag, &store})
+        item->commit(m_db);
+
+    vector<IndexKey> expected({box.path(), shelf.path(), room.path()});
+    EXPECT_EQ(bag.upward_ids(m_db), expected);
+
+    // moving the shelf carries the paths below it along
+    store += shelf;
+    store.commit(m_db);
+    shelf.commit(m_db);
+    expected = {box.path(), shelf.path(), store.path()};
+    EXPECT_EQ(bag.upward_ids(m_db), expected);
+
+    // a legacy record only names the parent
+    m_db.impl().set(HierarchyUpKey(bag.path()).string(), box.path().string());
+    EXPECT_EQ(bag.upward_ids(m_db), expected);
+
+    // ids holding the path terminator would be mis-split
+    EXPECT_THROW(box += IndexKey({"Item", "x<"}), std::runtime_error);
+
+    // children added while their ancestors move get the final path
+    vector<types::Item<>> added(50);
+    thread mover([&] {
+        for (int i = 0; i < 50; i++) {
+            types::Item<> to, moved;
+            to.get(m_db, (i % 2 ? store : room).id());
+            moved.get(m_db, shelf.id());
+            to += moved;
+            to.commit(m_db);
+            moved.commit(m_db);
+        }
+    });
+    for (auto &child : added) {
+        types::Item<> parent;
+        parent.get(m_db, box.id());
+        parent += child;
+        child.commit(m_db);
+        parent.commit(m_db);
+    }
+    mover.join();
+
+    expected = {box.path(), shelf.path(), store.path()};
+    for (auto &child : added)
+        EXPECT_EQ(child.upward_ids(m_db), expected);
+}
+
+TEST_F(DatabaseTest, descendants) {
+    // room > 4 shelves > 100 items and a picture each, and a category
+    // listed before the shelves
+    types::Item<> room;
+    vector<types::Item<>> shelves(4), items(400);
+    for (size_t i = 0; i < items.size(); i++) {
+        shelves[i / 100] += items[i];
+        items[i].commit(m_db);
+    }
+    for (size_t i = 0; i < shelves.size(); i++) {
+        shelves[i] += IndexKey({"Picture", "shelf" + to_string(i)});
+        room += shelves[i];
+        shelves[i].commit(m_db);
+    }
+    room += IndexKey({"Category", "a"});
+    room.commit(m_db);
+
+    // walked sequentially and fanned out per shelf; a narrow filter runs
+    // the pages out of visits, and the shelf walked next to the category
+    // past what the category left over
+    for (size_t fanout : {1, 4}) {
+        for (size_t limit : {2, 7, 300}) {
+            SubtreeScan scan;
+            scan.limit = limit;
+            scan.fanout = fanout;
+            if (limit == 2)
+                scan.types = {"Picture"};
+            set<string> seen;
+            vector<SubtreeScan::Node> nodes;
+            string cursor, next;
+            size_t pages = 0;
+            do {
+                ASSERT_TRUE(scan.page(m_db, room.path(), cursor, &nodes,
+                                                                 &next));
+                EXPECT_LE(nodes.size(), limit);
+                for (const auto &node : nodes)
+                    EXPECT_TRUE(seen.insert(node.key.string()).second);
+                cursor = next;
+                ASSERT_LT(++pages, 1000);
+            } while (!cursor.empty());
+            EXPECT_EQ(seen.size(), limit == 2 ? shelves.size() :
+                            2 * shelves.size() + items.size() + 1);
+        }
+    }
+
+    SubtreeScan scan;
+    scan.max_depth = 1;
+    vector<SubtreeScan::Node> nodes;
+    string next;
+    ASSERT_TRUE(scan.page(m_db, room.path(), "", &nodes, &next));
+    EXPECT_EQ(nodes.size(), shelves.size() + 1);
+    EXPECT_TRUE(next.empty());
+    EXPECT_FALSE(scan.page(m_db, shelves[0].path(),
+                           items[100].path().string(), &nodes, &next));
+}
+
+TEST_F(DatabaseTest, memory_backend) {
+    MemoryDatabase mdb;
+    mdb.open("");
+
+    types::Item<MemoryDatabase> item;
+    item["testattr"] = "test";
+    item.commit(mdb);
+
+    types::Item<MemoryDatabase> loaded;
+    loaded.get(mdb, item.id());
+    EXPECT_EQ(item.repr_string(), loaded.repr_string());
+}
+
+TEST_F(DatabaseTest, hash_backend) {
+    HashDatabase hdb;
+    DatabaseOptions options;
+    options.buckets = 1 << 16;
+    hdb.open(std::string(g_argv[1]) + ".kch", options);
+
+    EXPECT_TRUE(hdb.impl().set("key", "value"));
+    std::string value;
+    EXPECT_TRUE(hdb.impl().get("key", &value));
+    EXPECT_EQ(value, "value");
+    hdb.clear();
+}
+
+TEST_F(DatabaseTest, write_batch) {
+    WriteBatch<Database<>> batch(m_db);
+    batch.set("batch:one", "1");
+    batch.set("batch:two", "2");
+    batch.remove("batch:two");
+    batch.remove("batch:missing");
+    batch.commit();
+    EXPECT_TRUE(batch.empty());
+
+    std::string value;
+    EXPECT_TRUE(m_db.impl().get("batch:one", &value));
+    EXPECT_EQ(value, "1");
+    EXPECT_FALSE(m_db.impl().get("batch:two", &value));
+}
+
+TEST_F(DatabaseTest, scan) {
+    WriteBatch<Database<>> batch(m_db);
+    batch.set("scan:a", "0");
+    batch.set("scan:a.1", "1");
+    batch.set("scan:a.2", "2");
+    batch.set("scan:b.1", "3");
+    batch.commit();
+
+    vector<pair<string, string>> records;
+    for (const auto &record : m_db.scan("scan:a."))
+        records.emplace_back(record.first, record.second);
+
+    ASSERT_EQ(records.size(), 2);
+    EXPECT_EQ(records[0], make_pair(string("scan:a.1"), string("1")));
+    EXPECT_EQ(records[1], make_pair(string("scan:a.2"), string("2")));
+    EXPECT_EQ(m_db.scan("scan:c.").begin(), m_db.scan("scan:c.").end());
+}
+
+TEST_F(DatabaseTest, group_commit) {
+    m_db.enable_group_commit(SyncPolicy::BATCH);
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 8; i++) {
+        threads.emplace_back([this, i] {
+            WriteBatch<Database<>> batch(m_db);
+            batch.set("group:" + std::to_string(i), std::to_string(i));
+            batch.commit();
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+
+    EXPECT_GE(m_db.group_commit()->transactions(), 1);
+    EXPECT_LE(m_db.group_commit()->transactions(), 8);
+    m_db.disable_group_commit();
+
+    std::string value;
+    for (int i = 0; i < 8; i++) {
+        EXPECT_TRUE(m_db.impl().get("group:" + std::to_string(i), &value));
+        EXPECT_EQ(value, std::to_string(i));
+    }
+}
+
+TEST_F(DatabaseTest, striped_locks) {
+    types::Item<> a, b;
+    a.commit(m_db);
+    b.commit(m_db);
+
+    // both commits lock the stripes of a and b, in opposite roles
+    auto link = [this](types::Item<> &from, types::Item<> &to) {
+        for (int i = 0; i < 100; i++) {
+            types::Item<> object;
+            object.get(m_db, from.id());
+            object.associate(to.path());
+            object.commit(m_db);
+        }
+    };
+    std::thread forward(link, std::ref(a), std::ref(b));
+    std::thread backward(link, std::ref(b), std::ref(a));
+    forward.join();
+    backward.join();
+
+    EXPECT_NE(m_db.impl().check(LinkKey({a.path(), b.path()})), -1);
+    EXPECT_NE(m_db.impl().check(LinkKey({b.path(), a.path()})), -1);
+}
+
+TEST_F(DatabaseTest, snapshot) {
+    // the rows of shelf2 sort between the attributes and the down rows
+    // of shelf
+    types::Category<> shelf("shelf"), shelf2("shelf2"), bin("bin");
+    shelf["a"] = "1";
+    shelf2["a"] = "2";
+    shelf += bin;
+    for (auto *category : {&shelf, &shelf2, &bin})
+        category->commit(m_db);
+
+    WriteBatch<Database<>> batch(m_db);
+    batch.set("snapshot:before", "1");
+    batch.commit();
+
+    auto snapshot = m_db.snapshot(string(g_argv[1]) + ".snapshot");
+    EXPECT_TRUE(snapshot->read_only());
+
+    batch.set("snapshot:after", "2");
+    batch.commit();
+
+    string value;
+    EXPECT_TRUE(snapshot->impl().get("snapshot:before", &value));
+    EXPECT_FALSE(snapshot->impl().get("snapshot:after", &value));
+    types::Category<> copied;
+    copied.get(*snapshot, "shelf");
+    EXPECT_EQ(copied.attributes().at("a"), "1");
+    EXPECT_EQ(copied.down_ids().size(), 1);
+    copied.get(*snapshot, "shelf2");
+    EXPECT_EQ(copied.attributes().at("a"), "2");
+
+    WriteBatch<Database<>> readonly(*snapshot);
+    readonly.set("snapshot:write", "3");
+    EXPECT_THROW(readonly.commit(), std::runtime_error);
+
+    MemoryDatabase mdb;
+    mdb.open("");
+    EXPECT_THROW(mdb.snapshot(string(g_argv[1]) + ".memory"),
+                 std::runtime_error);
+}
+
+TEST_F(DatabaseTest, sharded) {
+    typedef types::Item<ShardedDatabase<>> ShardedItem;
+
+    ShardedDatabase<> db(4);
+    db.open(string(g_argv[1]) + ".sharded");
+
+    vector<ShardedItem> items(16);
+    for (size_t i = 1; i < items.size(); i++)
+        items[0] *= items[i];
+    for (ShardedItem &item : items)
+        item.commit(db);
+
+    ShardedItem first;
+    first.get(db, items[0].id());
+    EXPECT_EQ(first.assoc_ids<ShardedItem>().size(), items.size() - 1);
+
+    for (size_t i = 1; i < items.size(); i++) {
+        ShardedItem item;
+        item.get(db, items[i].id());
+        ASSERT_EQ(item.assoc_ids<ShardedItem>().size(), 1);
+        EXPECT_EQ(item.assoc_ids<ShardedItem>()[0], first.path());
+    }
+
+    // a walk without a key covers every shard
+    size_t walked = 0;
+    std::unique_ptr<ShardRouter<kyotocabinet::TreeDB>::Cursor> cur(
+                                                  db.impl().cursor());
+    for (bool more = cur->jump(); more; more = cur->step())
+        walked++;
+    size_t stored = 0;
+    for (size_t i = 0; i < db.shards(); i++)
+        stored += db.impl().at(i).count();
+    EXPECT_EQ(walked, stored);
+    db.close();
+
+    // the shard count comes from the manifest
+    ShardedDatabase<> reopened;
+    reopened.open(string(g_argv[1]) + ".sharded");
+    EXPECT_EQ(reopened.shards(), 4);
+    reopened.close();
+    ShardedDatabase<> mismatched(2);
+    EXPECT_THROW(mismatched.open(string(g_argv[1]) + ".sharded"),
+                 std::runtime_error);
+
+    db.open(string(g_argv[1]) + ".sharded");
+    db.clear();
+}
+
+TEST_F(DatabaseTest, binary_keys) {
+    const string uuid = "0b7e1c4a-6d2f-4e8a-9c3b-5f1a2d3e4c5b";
+    const vector<string> keys = {
+        "Item:" + uuid,
+        "Item:" + uuid + ".name",
+        "Item:" + uuid + "*Owner:fred",
+        "Item:" + uuid + "%user_handle",
+        "Item:" + uuid + "<up",
+        "Item:" + uuid + ">Item:" + uuid,
+        "Item:" + uuid + ".",
+        "Category",
+        "Item:0B7E1C4A-6D2F-4E8A-9C3B-5F1A2D3E4C5B",
+        "no separators at all:",
+    };
+
+    KeyCodec codec;
+    for (const string &key : keys) {
+        string encoded = codec.encode(key, true);
+        EXPECT_EQ(codec.decode(encoded), key);
+    }
+    EXPECT_LT(codec.encode(keys[1], false).size() * 2, keys[1].size());
+    EXPECT_EQ(codec.encode("Unknown:x", false)[0], KeyCodec::RAW_TAG);
+
+    CompactTreeDatabase db;
+    db.open(string(g_argv[1]) + ".compact");
+    types::Item<CompactTreeDatabase> item;
+    item["name"] = "compact";
+    item.commit(db);
+
+    types::Item<CompactTreeDatabase> copy;
+    copy.get(db, item.id());
+    EXPECT_EQ(static_cast<string>(copy["name"]), "compact");
+    db.clear();
+}
+
+int main(int argc, char **argv) {
+    assert(argc > 1);
+    g_argc = argc;
+    g_argv = argv;
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -65,6 +65,69 @@ TEST_F(DatamodelTest, repr_test) {
     up->commit(m_db);
 }
 
+TEST_F(DatamodelTest, attribute_dirty_tracking) {
+    typedef Container<Database<>, types::Item<>> Attributes;
+
+    types::Item<> item;
+    item["a"] = "1";
+    item["b"] = "2";
+    item.commit(m_db);
+
+    types::Item<> loaded;
+    loaded.get(m_db, item.id());
+    EXPECT_FALSE(loaded.Attributes::modified());
+    loaded["a"] = "1";
+    EXPECT_FALSE(loaded.Attributes::modified());
+
+    loaded["b"] = "3";
+    loaded["c"].remove();
+    EXPECT_TRUE(loaded.Attributes::modified());
+    WriteBatch<Database<>> batch(m_db);
+    loaded.Attributes::commit(m_db, batch);
+    ASSERT_EQ(batch.ops().size(), 1);
+    EXPECT_EQ(batch.ops().begin()->first,
+              AttributeKey({loaded.path().string(), "b"}).string());
+}
+
+TEST_F(DatamodelTest, type_registry) {
+    typedef types::StandardDataModel Model;
+    EXPECT_GE(Model::type_id("Item"), 0);
+    EXPECT_EQ(Model::type_id("NoSuchType"), -1);
+    EXPECT_THROW(Model::create("NoSuchType"), exceptions::NoSuchType);
+
+    // released objects are reused by the same thread
+    DatamodelObject<Database<>> *first;
+    {
+        auto object = Model::acquire("Item");
+        EXPECT_EQ(object->virtual_type(), "Item");
+        (*static_cast<types::Item<> *>(object.get()))["name"] = "first";
+        first = object.get();
+    }
+    auto object = Model::acquire("Item");
+    EXPECT_EQ(object.get(), first);
+    // emptied in place on release
+    EXPECT_TRUE(static_cast<types::Item<> *>(object.get())
+                                           ->attributes().empty());
+}
+
+TEST_F(DatamodelTest, key_view) {
+    // long enough for the vectorized separator search
+    std::string local = "Item:" + std::string(40, 'a');
+    std::string path = local + "*Owner:" + std::string(40, 'b');
+
+    LinkKeyView view(path);
+    ASSERT_TRUE(view.good());
+    EXPECT_EQ(view.local_part(), local);
+    EXPECT_EQ(view.remote_part(), "Owner:" + std::string(40, 'b'));
+
+    AttributeKeyView attr("Item:x..name");
+    EXPECT_EQ(attr.elements(), 2);
+    EXPECT_EQ(attr.attribute_part(), "name");
+
+    EXPECT_EQ(LinkKey(path).local_part(), IndexKey(local));
+    EXPECT_LT(IndexKey("Item:a"), IndexKey("Item:b"));
+}
+
 int main(int argc, char **argv) {
     assert(argc > 1);
     g_argc = argc;
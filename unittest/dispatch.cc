@@ -0,0 +1,30 @@
+#include <assert.h>
+#include <gtest/gtest.h>
+#include <iostream>
+#include "stdtypes.hh"
+#include "rpc.hh"
+
+using namespace std;
+using namespace inventory;
+
+static int g_argc;
+static char **g_argv;
+
+typedef types::Item<> Item;
+
+TEST(DispatchTest, method_table) {
+    const auto &table = Item::rpc_method_table();
+    for (const string &name : Item::rpc_methods()) {
+        ASSERT_NE(table.find(name), nullptr);
+        EXPECT_EQ(table.find(name)->name, name);
+    }
+    EXPECT_EQ(table.find("no.such.method"), nullptr);
+}
+
+int main(int argc, char **argv) {
+    assert(argc > 1);
+    g_argc = argc;
+    g_argv = argv;
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
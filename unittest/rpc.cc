@@ -25,8 +25,11 @@ public:
     }
 
     virtual void reply_async(std::unique_ptr<JSONRPC::ResponseBase> response) {
-        std::cout << std::string(*response) << std::endl;
+        last_reply = std::string(*response);
+        std::cout << last_reply << std::endl;
     }
+
+    std::string last_reply;
 };
 
 class RPCTest : public ::testing::Test {
@@ -155,6 +158,25 @@ TEST_F(RPCTest, RPC_repr_get) {
     req.complete<Database<>, StandardDataModel>(m_db);
 }
 
+TEST_F(RPCTest, RPC_request_arena) {
+    Item<> testobj;
+    testobj["testattr"] = "test"; 
+    testobj.commit(m_db);
+
+    std::string reqstr = "{\"jsonrpc\": \"2.0\", \"id\": 1, \"method\": "
+               "\"datamodel.repr.get\", \"params\": {\"type\": \"Item\","
+                                   " \"id\": \"" + testobj.id() + "\"}}";
+    for (int i = 0; i < 2; i++) {
+        std::unique_ptr<JSONRPC::Request> jreq(new JSONRPC::Request(reqstr)); 
+        RPC::ServerRequest req(std::move(jreq), m_session);
+        req.complete<Database<>, StandardDataModel>(m_db);
+
+        // the reply was serialized before the arena went away
+        EXPECT_NE(m_session->last_reply.find("testattr"), std::string::npos);
+        EXPECT_EQ(RPC::RequestArena::local().size(), 0u);
+    }
+}
+
 class DummySession : public RPC::ClientSession {
 public:
     DummySession()